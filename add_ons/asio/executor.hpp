@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+#ifndef INC_ASIO_EXECUTOR_HPP_
+#define INC_ASIO_EXECUTOR_HPP_
+
+//
+// Promise executors based on promise-cpp and boost::asio
+//
+// Functions --
+//   Executor asioExecutor(boost::asio::io_service &io);
+//   Executor asioExecutor(const ASIO_EXECUTOR &executor);  // io_context executor, strand ...
+//
+// Usage --
+//   promise.then(asioExecutor(io), [](int value) { ... });  // run in the io thread
+//
+
+#include "promise-cpp/promise.hpp"
+#include <boost/asio.hpp>
+
+namespace promise {
+
+inline Executor asioExecutor(boost::asio::io_service &io) {
+    return Executor([&io](Executor::Function &&func) {
+#if BOOST_VERSION >= 106600
+        boost::asio::post(io, std::move(func));
+#else
+        io.post(std::move(func));
+#endif
+    });
+}
+
+template<typename ASIO_EXECUTOR>
+inline Executor asioExecutor(const ASIO_EXECUTOR &executor) {
+    return Executor([executor](Executor::Function &&func) {
+#if BOOST_VERSION >= 106600
+        boost::asio::post(executor, std::move(func));
+#else
+        const_cast<ASIO_EXECUTOR &>(executor).post(std::move(func));
+#endif
+    });
+}
+
+}
+
+#endif
@@ -84,30 +84,51 @@ inline Promise async_connect(
 
 
 
+// Cancel the pending operations of stream in its own executor,
+// called when the promise of the operation is cancelled
+template<typename Stream>
+inline void cancelStream(Stream &stream) {
+    boost::asio::post(stream.get_executor(), [&stream]() {
+        try {
+            boost::beast::get_lowest_layer(stream).cancel();
+        }
+        catch (...) {
+        }
+    });
+}
+
 template<typename Stream, typename Buffer, typename Content>
 inline Promise async_read(Stream &stream,
     Buffer &buffer,
-    Content &content) {
+    Content &content,
+    const CancellationToken &token = CancellationToken()) {
     //read
     return newPromise([&](Defer &defer) {
+        defer.onCancel([&stream]() {
+            cancelStream(stream);
+        });
         boost::beast::http::async_read(stream, buffer, content,
             [defer](boost::system::error_code err,
                 std::size_t bytes_transferred) {
                 setPromise(defer, err, "read", bytes_transferred);
         });
-    });
+    }, token);
 }
 
 template<typename Stream, typename Content>
-inline Promise async_write(Stream &stream, Content &content) {
+inline Promise async_write(Stream &stream, Content &content,
+    const CancellationToken &token = CancellationToken()) {
     return newPromise([&](Defer &defer) {
+        defer.onCancel([&stream]() {
+            cancelStream(stream);
+        });
         //write
         boost::beast::http::async_write(stream, content,
             [defer](boost::system::error_code err,
                 std::size_t bytes_transferred) {
                 setPromise(defer, err, "write", bytes_transferred);
         });
-    });
+    }, token);
 }
 
 
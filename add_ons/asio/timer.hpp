@@ -32,7 +32,8 @@
 //
 // Functions --
 //   Promise yield(boost::asio::io_service &io);
-//   Promise delay(boost::asio::io_service &io, uint64_t time_ms);
+//   Promise delay(boost::asio::io_service &io, uint64_t time_ms,
+//                 const CancellationToken &token = CancellationToken());
 //   void cancelDelay(Promise promise);
 // 
 //   Promise setTimeout(boost::asio::io_service &io,
@@ -64,7 +65,9 @@ inline Promise yield(boost::asio::io_service &io){
     return promise;
 }
 
-inline Promise delay(boost::asio::io_service &io, uint64_t time_ms) {
+// The timer is cancelled when the promise is settled or cancelled
+inline Promise delay(boost::asio::io_service &io, uint64_t time_ms,
+                     const CancellationToken &token = CancellationToken()) {
     auto timer = std::make_shared<boost::asio::steady_timer>(io, std::chrono::milliseconds(time_ms));
     return newPromise([timer, &io](Defer &defer) {
         timer->async_wait([defer, timer](const boost::system::error_code& error_code) {
@@ -73,13 +76,13 @@ inline Promise delay(boost::asio::io_service &io, uint64_t time_ms) {
                 defer.resolve();
             }
         });
-    }).finally([timer]() {
+    }, token).finally([timer]() {
         timer->cancel();
     });
 }
 
 inline void cancelDelay(Promise promise) {
-    promise.reject();
+    promise.cancel();
 }
 
 inline Promise setTimeout(boost::asio::io_service &io,
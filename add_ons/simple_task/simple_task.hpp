@@ -42,6 +42,7 @@
 #include <condition_variable>
 #include <utility>
 #include <stdexcept>
+#include <vector>
 #include "promise-cpp/promise.hpp"
 
 
@@ -51,12 +52,14 @@ class Service {
     using TimePoint = std::chrono::time_point<std::chrono::steady_clock>;
     using Timers    = std::multimap<TimePoint, Defer>;
     using Tasks     = std::deque<Defer>;
+    using Posted    = std::vector<std::function<void()>>;
 #if PROMISE_MULTITHREAD
     using Mutex     = promise::Mutex;
 #endif
 
     Timers timers_;
     Tasks  tasks_;
+    Posted posted_;
 #if PROMISE_MULTITHREAD
     //std::recursive_mutex mutex_;
     std::shared_ptr<Mutex> mutex_;
@@ -122,6 +125,23 @@ public:
         });
     }
 
+    // Run the function in this io thread, functions posted between
+    // two loops are run as one batch
+    void post(std::function<void()> &&func) {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<Mutex> lock(*mutex_);
+#endif
+        posted_.push_back(std::move(func));
+        if (posted_.size() == 1)
+            cond_.notify_one();
+    }
+
+    // Executor to run promise continuations in this io thread,
+    // for promise.then(service.executor(), ...)
+    promise::Executor executor() {
+        return promise::Executor(*this);
+    }
+
     // Set if the io thread will auto exist if no waiting tasks and timers.
     void setAutoStop(bool isAutoExit) {
 #if PROMISE_MULTITHREAD
@@ -138,13 +158,24 @@ public:
         std::unique_lock<Mutex> lock(*mutex_);
 #endif
 
-        while(!isStop_ && (!isAutoStop_ || tasks_.size() > 0 || timers_.size() > 0)) {
+        while(!isStop_ && (!isAutoStop_ || tasks_.size() > 0 || timers_.size() > 0 || posted_.size() > 0)) {
 
-            if (tasks_.size() == 0 && timers_.size() == 0) {
+            if (tasks_.size() == 0 && timers_.size() == 0 && posted_.size() == 0) {
                 cond_.wait(lock);
                 continue;
             }
 
+            // Run all posted functions with one lock round trip
+            if (!isStop_ && posted_.size() > 0) {
+                Posted posted;
+                posted.swap(posted_);
+#if PROMISE_MULTITHREAD
+                unlock_guard_t unlock(mutex_);
+#endif
+                for (auto &func : posted)
+                    func();
+            }
+
             while (!isStop_ && timers_.size() > 0) {
                 TimePoint now = std::chrono::steady_clock::now();
                 TimePoint time = timers_.begin()->first;
@@ -153,7 +184,7 @@ public:
                     tasks_.push_back(defer);
                     timers_.erase(timers_.begin());
                 }
-                else if (tasks_.size() == 0) {
+                else if (tasks_.size() == 0 && posted_.size() == 0) {
                     //std::this_thread::sleep_for(time - now);
                     cond_.wait_for(lock, time - now);
                 }
@@ -162,25 +193,31 @@ public:
                 }
             }
 
-            // Check fixed size of tasks in this loop, so that timer have a chance to run.
+            // Resolve the tasks of this loop as one batch, with one unlock of
+            // the service, so that timer have a chance to run.
             if(!isStop_ && tasks_.size() > 0) {
-                size_t size = tasks_.size();
-                for(size_t i = 0; i < size; ++i){
-                    Defer defer = tasks_.front();
-                    tasks_.pop_front();
-
+                promise::SettleBatch batch;
+                batch.reserve(tasks_.size());
+                for (Defer &defer : tasks_)
+                    batch.resolve(std::move(defer));
+                tasks_.clear();
 #if PROMISE_MULTITHREAD
-                    unlock_guard_t unlock(mutex_);
-                    defer.resolve();
-                    break; // for only once
-#else
-                    defer.resolve(); // loop with the size
+                unlock_guard_t unlock(mutex_);
 #endif
-                }
+                batch.run();
             }
         }
 
-        // Clear pending timers and tasks
+        // Clear pending timers and tasks. The posted functions may reject
+        // their continuations when destroyed, so out of the lock too.
+        {
+            Posted posted;
+            posted.swap(posted_);
+#if PROMISE_MULTITHREAD
+            unlock_guard_t unlock(mutex_);
+#endif
+            posted.clear();
+        }
         while (timers_.size() > 0 || tasks_.size()) {
             while (timers_.size() > 0) {
                 Defer defer = timers_.begin()->second;
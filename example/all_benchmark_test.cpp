@@ -0,0 +1,125 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * Fan-out of all() with 10^5 and 10^6 promises, untyped and typed, which
+ * are resolved in one thread, and then in two threads at the same time
+ * to check the result (build with -fsanitize=thread to check the races).
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "promise-cpp/promise.hpp"
+#include "promise-cpp/typed_promise.hpp"
+
+using namespace promise;
+namespace chrono       = std::chrono;
+using     steady_clock = std::chrono::steady_clock;
+
+void dump(std::string name, int n,
+    steady_clock::time_point start,
+    steady_clock::time_point end)
+{
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(end - start);
+    std::cout << name << "    " << n << "      " <<
+        ns.count() / n <<
+        "ns/op" << std::endl;
+}
+
+template<typename PROMISE>
+void resolveAll(std::vector<PROMISE> &promises, int threads) {
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; ++t) {
+        workers.emplace_back([&promises, t, threads]() {
+            for (size_t i = t; i < promises.size(); i += threads)
+                promises[i].resolve((int)i);
+        });
+    }
+    for (size_t i = 0; i < promises.size(); i += threads)
+        promises[i].resolve((int)i);
+    for (std::thread &worker : workers)
+        worker.join();
+}
+
+bool checkSum(long long sum, int n) {
+    return sum == (long long)n * (n - 1) / 2;
+}
+
+void test_untyped(int n, int threads) {
+    std::vector<Promise> promises;
+    promises.reserve(n);
+    for (int i = 0; i < n; ++i)
+        promises.push_back(newPromise());
+
+    long long sum = -1;
+    steady_clock::time_point start = steady_clock::now();
+    all(promises).then([&sum](const std::vector<any> &values) {
+        sum = 0;
+        for (const any &value : values)
+            sum += value.cast<int>();
+    });
+    resolveAll(promises, threads);
+    steady_clock::time_point end = steady_clock::now();
+
+    if (!checkSum(sum, n))
+        std::cout << "ERROR: wrong values of all()" << std::endl;
+    dump("BenchmarkAll_" + std::to_string(n) + "_" + std::to_string(threads) + "threads", n, start, end);
+}
+
+void test_typed(int n, int threads) {
+    std::vector<typed::Promise<int>> promises;
+    promises.reserve(n);
+    for (int i = 0; i < n; ++i)
+        promises.push_back(typed::newPromise<int>());
+
+    long long sum = -1;
+    steady_clock::time_point start = steady_clock::now();
+    typed::all(promises).then([&sum](const std::vector<int> &values) {
+        sum = 0;
+        for (int value : values)
+            sum += value;
+    });
+    resolveAll(promises, threads);
+    steady_clock::time_point end = steady_clock::now();
+
+    if (!checkSum(sum, n))
+        std::cout << "ERROR: wrong values of typed::all()" << std::endl;
+    dump("BenchmarkTypedAll_" + std::to_string(n) + "_" + std::to_string(threads) + "threads", n, start, end);
+}
+
+int main() {
+    for (int n : { 100000, 1000000 }) {
+        test_untyped(n, 1);
+        test_typed(n, 1);
+    }
+    test_untyped(100000, 2);
+    test_typed(100000, 2);
+    return 0;
+}
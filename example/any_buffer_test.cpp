@@ -0,0 +1,164 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Values stored in the inline buffer of promise::any, which makes no heap
+ * allocation. A void resolve() or reject() packs an empty std::vector<any>
+ * of the arguments, so settling a promise with one handler allocates none.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iostream>
+#include <string>
+#include <memory>
+#include <new>
+#include <vector>
+#include <system_error>
+#include "promise-cpp/promise.hpp"
+
+static size_t g_allocations = 0;
+
+// All forms of operator new and delete take the memory by malloc() and give
+// it back by free(), which is kept out of line for -Wmismatched-new-delete.
+#if defined(_MSC_VER)
+#define COUNTED_NOINLINE __declspec(noinline)
+#else
+#define COUNTED_NOINLINE __attribute__((noinline))
+#endif
+
+static void *allocate(size_t size) {
+    ++g_allocations;
+    return malloc(size == 0 ? 1 : size);
+}
+
+COUNTED_NOINLINE static void deallocate(void *ptr) noexcept {
+    free(ptr);
+}
+
+void *operator new(size_t size) {
+    void *ptr = allocate(size);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    return allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return allocate(size);
+}
+
+void operator delete(void *ptr) noexcept {
+    deallocate(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    deallocate(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+    deallocate(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+    deallocate(ptr);
+}
+
+using namespace promise;
+
+static int g_failures = 0;
+
+void check(bool ok, const std::string &what) {
+    std::cout << (ok ? "OK: " : "ERROR: ") << what << std::endl;
+    if (!ok) ++g_failures;
+}
+
+// Number of allocations made by run()
+template<typename FUNC>
+size_t allocations(const FUNC &run) {
+    size_t before = g_allocations;
+    run();
+    return g_allocations - before;
+}
+
+void test_values() {
+    size_t count = allocations([]() {
+        any arguments = std::vector<any>();
+        any copy = arguments;
+        any moved = std::move(copy);
+        any values[] = { any(1), any((size_t)2), any(nullptr), any(std::error_code()) };
+        (void)values;
+    });
+    check(count == 0, "empty arguments and small scalars are stored inline");
+
+    count = allocations([]() {
+        any text = std::string(100, 'x');
+        (void)text;
+    });
+    check(count > 0, "a large value is stored on heap");
+}
+
+void test_void_resolve() {
+    int called = 0;
+    Promise promise = newPromise();
+    promise.then([&called]() { ++called; });
+    size_t count = allocations([&promise]() { promise.resolve(); });
+    check(count == 0 && called == 1, "void resolve() of a promise makes no allocation");
+}
+
+void test_void_reject() {
+    int called = 0;
+    Promise promise = newPromise();
+    promise.fail([&called]() { ++called; });
+    size_t count = allocations([&promise]() { promise.reject(); });
+    check(count == 0 && called == 1, "void reject() of a promise makes no allocation");
+}
+
+void test_void_defer() {
+    int called = 0;
+    std::vector<Defer> defers;
+    newPromise([&defers](Defer &defer) {
+        defers.push_back(defer);
+    }).then([&called]() { ++called; });
+    size_t count = allocations([&defers]() { defers[0].resolve(); });
+    check(count == 0 && called == 1, "void resolve() of a defer makes no allocation");
+}
+
+int main() {
+    test_values();
+    test_void_resolve();
+    test_void_reject();
+    test_void_defer();
+    return g_failures == 0 ? 0 : 1;
+}
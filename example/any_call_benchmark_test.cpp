@@ -0,0 +1,117 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * Per-call cost of invoking a handler stored in promise::any, compared with
+ * building a std::function from the same handler before every call (which
+ * is what any_call used to do) and with calling the lambda directly.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <chrono>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+namespace chrono       = std::chrono;
+using     steady_clock = std::chrono::steady_clock;
+
+static const int N = 2000000;
+
+void dump(std::string name, int n,
+    steady_clock::time_point start,
+    steady_clock::time_point end)
+{
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(end - start);
+    std::cout << name << "    " << n << "      " <<
+        ns.count() / n <<
+        "ns/op" << std::endl;
+}
+
+// A capture big enough to make std::function allocate on copy
+struct Capture {
+    size_t *total_;
+    size_t pad_[3];
+};
+
+void test_direct() {
+    size_t total = 0;
+    Capture capture = { &total, { 1, 2, 3 } };
+    auto func = [capture](int value, const std::string &str) {
+        *capture.total_ += (size_t)value + str.size() + capture.pad_[0];
+    };
+    std::string str = "hello";
+    steady_clock::time_point start = steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+        func(i, str);
+    }
+    steady_clock::time_point end = steady_clock::now();
+    dump("BenchmarkDirect", N, start, end);
+    if (total == 0) std::cout << "ERROR: total = 0" << std::endl;
+}
+
+void test_std_function() {
+    size_t total = 0;
+    Capture capture = { &total, { 1, 2, 3 } };
+    auto func = [capture](int value, const std::string &str) {
+        *capture.total_ += (size_t)value + str.size() + capture.pad_[0];
+    };
+    std::string str = "hello";
+    steady_clock::time_point start = steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+        const auto &stdFunc = call_traits<decltype(func)>::to_std_function(func);
+        stdFunc(i, str);
+    }
+    steady_clock::time_point end = steady_clock::now();
+    dump("BenchmarkStdFunction", N, start, end);
+    if (total == 0) std::cout << "ERROR: total = 0" << std::endl;
+}
+
+void test_any_call() {
+    size_t total = 0;
+    Capture capture = { &total, { 1, 2, 3 } };
+    any func = [capture](int value, const std::string &str) {
+        *capture.total_ += (size_t)value + str.size() + capture.pad_[0];
+    };
+    any args = std::vector<any>{ any(1), any(std::string("hello")) };
+    steady_clock::time_point start = steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+        func.call(args);
+    }
+    steady_clock::time_point end = steady_clock::now();
+    dump("BenchmarkAnyCall", N, start, end);
+    if (total == 0) std::cout << "ERROR: total = 0" << std::endl;
+}
+
+int main() {
+    for (int round = 0; round < 3; ++round) {
+        test_direct();
+        test_std_function();
+        test_any_call();
+    }
+    return 0;
+}
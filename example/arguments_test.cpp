@@ -0,0 +1,160 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Unpacking of the resolved arguments into the parameters of the handlers.
+ * resolve(ARGS...) packs the arguments in a std::vector<any>, and a single
+ * argument is passed as is. The handlers view them in place, without
+ * copying the values.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+
+static int g_failures = 0;
+
+void check(bool ok, const std::string &what) {
+    std::cout << (ok ? "OK: " : "ERROR: ") << what << std::endl;
+    if (!ok) ++g_failures;
+}
+
+// Counts the copies, a moved body is not counted
+struct Body {
+    static int copies_;
+
+    explicit Body(const std::string &text)
+        : text_(text) {
+    }
+    Body(const Body &other)
+        : text_(other.text_) {
+        ++copies_;
+    }
+    Body(Body &&other) noexcept
+        : text_(std::move(other.text_)) {
+    }
+
+    std::string text_;
+};
+
+int Body::copies_ = 0;
+
+void test_single() {
+    Body::copies_ = 0;
+    std::string got;
+    newPromise([](Defer &defer) {
+        defer.resolve(Body("single"));
+    }).then([&](const Body &body) {
+        got = body.text_;
+        return Body(body.text_ + " again");
+    }).then([&](Body body) {
+        got += " " + body.text_;
+    });
+    check(got == "single single again" && Body::copies_ == 0, "a single argument is passed without copying");
+
+    any value;
+    newPromise([](Defer &defer) {
+        defer.resolve(42);
+    }).then([&](any arg) {
+        value = std::move(arg);
+    });
+    check(value.type() == type_id<int>() && value.cast<int>() == 42, "a single argument is not packed");
+}
+
+void test_multiple() {
+    Body::copies_ = 0;
+    std::string got;
+    newPromise([](Defer &defer) {
+        defer.resolve(200, Body("body"), std::string("text/plain"));
+    }).then([&](int status, const Body &body, const std::string &type) {
+        got = std::to_string(status) + " " + body.text_ + " " + type;
+    });
+    check(got == "200 body text/plain" && Body::copies_ == 0, "multiple arguments are unpacked without copying");
+
+    got.clear();
+    newPromise([](Defer &defer) {
+        defer.resolve(1, 2, 3);
+    }).then([&](int first, int second) {
+        got = std::to_string(first) + std::to_string(second);
+    });
+    check(got == "12", "the leading arguments are taken by fewer parameters");
+
+    size_t size = 0;
+    newPromise([](Defer &defer) {
+        defer.resolve(1, std::string("two"));
+    }).then([&](const std::vector<any> &args) {
+        size = args.size();
+        got = std::to_string(args[0].cast<int>()) + args[1].cast<std::string>();
+    });
+    check(size == 2 && got == "1two", "the packed arguments are taken as std::vector<any>");
+
+    any packed;
+    newPromise([](Defer &defer) {
+        defer.resolve(1, 2);
+    }).then([&](any arg) {
+        packed = std::move(arg);
+    });
+    check(packed.type() == type_id<std::vector<any>>(), "the packed arguments are taken as any");
+}
+
+void test_none() {
+    bool called = false;
+    any value = 1;
+    newPromise([](Defer &defer) {
+        defer.resolve();
+    }).then([&]() {
+        called = true;
+    }).then([&](any arg) {
+        value = std::move(arg);
+    });
+    check(called && value.empty(), "no argument calls the handler without parameters");
+}
+
+void test_mismatched() {
+    bool called = false;
+    bool rejected = false;
+    newPromise([](Defer &defer) {
+        defer.resolve(1, std::string("two"));
+    }).then([&](int, int) {
+        called = true;
+    }).fail([&](const bad_any_cast &) {
+        rejected = true;
+    });
+    check(!called && rejected, "mismatched arguments reject by bad_any_cast");
+}
+
+int main() {
+    test_single();
+    test_multiple();
+    test_none();
+    test_mismatched();
+    return g_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,256 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * Cancellation of promises by CancellationSource and Promise::cancel().
+ * The work of each promise is pending until cancelled, and registers its
+ * cleanup by Defer::onCancel().
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+
+static int g_failures = 0;
+static std::vector<Defer> g_pending;   // the pending works, like the io operations
+
+void check(bool ok, const std::string &what) {
+    std::cout << (ok ? "OK: " : "ERROR: ") << what << std::endl;
+    if (!ok) ++g_failures;
+}
+
+// Pending work, which sets *stopped when cancelled
+Promise work(bool *stopped, const CancellationToken &token = CancellationToken()) {
+    *stopped = false;
+    return newPromise([stopped](Defer &defer) {
+        defer.onCancel([stopped]() {
+            *stopped = true;
+        });
+        g_pending.push_back(defer);
+    }, token);
+}
+
+void test_token() {
+    CancellationSource source;
+    bool stopped = false;
+    bool cancelled = false;
+    work(&stopped, source.getToken()).fail([&](const cancelled_error &) {
+        cancelled = true;
+    });
+    source.cancel();
+    check(stopped && cancelled, "token cancels the work and rejects by cancelled_error");
+
+    bool started = false;
+    newPromise([&](Defer &) {
+        started = true;
+    }, source.getToken()).fail([](const cancelled_error &) {
+    });
+    check(!started, "work is not started with a cancelled token");
+}
+
+void test_then() {
+    CancellationSource source;
+    bool stopped = false;
+    bool cancelled = false;
+    Promise chain = newPromise([](Defer &) {
+    }, source.getToken());
+    chain.then([&]() {
+        return work(&stopped);
+    }).fail([&](const cancelled_error &) {
+        cancelled = true;
+    });
+
+    chain.resolve();
+    source.cancel();
+    check(stopped && cancelled, "token cancels the work returned by then()");
+}
+
+void test_all_race() {
+    bool stopped0 = false;
+    bool stopped1 = false;
+    bool cancelled = false;
+    Promise promise = all(work(&stopped0), work(&stopped1)).fail([&](const cancelled_error &) {
+        cancelled = true;
+    });
+    promise.cancel();
+    check(stopped0 && stopped1 && cancelled, "all() cancels the pending promises");
+
+    promise = race(work(&stopped0), work(&stopped1)).fail([](const cancelled_error &) {
+    });
+    promise.cancel();
+    check(stopped0 && stopped1, "race() cancels the pending promises");
+}
+
+void test_linked() {
+    CancellationSource parent;
+    CancellationSource child(parent.getToken());
+    bool called = false;
+    child.getToken().onCancel([&]() {
+        called = true;
+    });
+    parent.cancel();
+    check(child.isCancelled() && called, "linked source is cancelled with the parent");
+
+    CancellationSource source;
+    bool removed = true;
+    size_t id = source.getToken().onCancel([&]() {
+        removed = false;
+    });
+    source.getToken().removeOnCancel(id);
+    source.cancel();
+    check(removed, "removed callback is not called");
+}
+
+void test_settled() {
+    bool stopped = false;
+    bool resolved = false;
+    Promise promise = newPromise([&](Defer &defer) {
+        defer.onCancel([&]() {
+            stopped = true;
+        });
+        defer.resolve();
+    }).then([&]() {
+        resolved = true;
+    });
+    promise.cancel();
+    check(resolved && !stopped, "settled promise is not cancelled");
+}
+
+// The combinator over two pending promises is released when the promises
+// are abandoned, a handler of its result keeps the tracker
+bool releasedWhenAbandoned(const std::function<Promise(Promise, Promise)> &combine) {
+    std::shared_ptr<int> tracker = std::make_shared<int>(0);
+    std::weak_ptr<int> observer = tracker;
+    {
+        std::vector<Defer> defers;
+        auto pending = [&defers]() {
+            return newPromise([&defers](Defer &defer) {
+                defers.push_back(defer);
+            });
+        };
+        combine(pending(), pending()).then([tracker]() {
+        });
+        tracker.reset();
+    }
+    return observer.expired();
+}
+
+// The handler cancels its own chain, the running step is not rejected
+void test_running() {
+    CancellationSource source;
+    int value = 0;
+    bool cancelled = false;
+    newPromise([](Defer &defer) {
+        g_pending.push_back(defer);
+    }, source.getToken()).then([&](int arg) {
+        source.cancel();
+        return arg + 1;
+    }).then([&](int arg) {
+        value = arg;
+    }).fail([&](const cancelled_error &) {
+        cancelled = true;
+    });
+    g_pending.back().resolve(1);
+    check(value == 2 && !cancelled, "cancel while a handler runs lets it finish");
+}
+
+// Cancelled while the continuation hops to its executor, it is posted once
+void test_hopping() {
+    std::vector<Executor::Function> posted;
+    Executor executor([&posted](Executor::Function &&func) {
+        posted.push_back(std::move(func));
+    });
+    CancellationSource source;
+    int called = 0, value = 0;
+    bool cancelled = false;
+    newPromise([](Defer &defer) {
+        g_pending.push_back(defer);
+    }, source.getToken()).then(executor, [&](int arg) {
+        ++called;
+        return arg + 1;
+    }).then([&](int arg) {
+        value = arg;
+    }).fail([&](const cancelled_error &) {
+        cancelled = true;
+    });
+    g_pending.back().resolve(1);
+    source.cancel();
+    size_t hops = posted.size();
+    for (size_t i = 0; i < posted.size(); ++i)
+        posted[i]();
+    check(hops == 1 && called == 1 && value == 2 && !cancelled, "cancel while a continuation hops lets it run once");
+}
+
+void test_abandoned() {
+    check(releasedWhenAbandoned([](Promise p0, Promise p1) {
+        return all(p0, p1);
+    }), "abandoned all() is released");
+    check(releasedWhenAbandoned([](Promise p0, Promise p1) {
+        return race(p0, p1);
+    }), "abandoned race() is released");
+}
+
+// Error which is tracked by a weak reference
+struct tracked_error : public std::runtime_error {
+    explicit tracked_error(const std::shared_ptr<int> &tracker)
+        : std::runtime_error("tracked")
+        , tracker_(tracker) {
+    }
+    std::shared_ptr<int> tracker_;
+};
+
+void test_handled_error() {
+    std::shared_ptr<int> tracker = std::make_shared<int>(0);
+    std::weak_ptr<int> observer = tracker;
+    bool handled = false;
+    newPromise([&tracker](Defer &defer) {
+        defer.reject(std::make_exception_ptr(tracked_error(tracker)));
+    }).fail([&handled](const std::runtime_error &) {
+        handled = true;
+    });
+    tracker.reset();
+    check(handled && observer.expired(), "handled rejection is released");
+}
+
+int main() {
+    test_token();
+    test_then();
+    test_all_race();
+    test_linked();
+    test_settled();
+    test_running();
+    test_hopping();
+    test_abandoned();
+    test_handled_error();
+    g_pending.clear();
+    return g_failures == 0 ? 0 : 1;
+}
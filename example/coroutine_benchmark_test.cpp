@@ -0,0 +1,304 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * Cost of a keep-alive session written with then() handlers, as do_session()
+ * in asio_http_server.cpp is, against the same session written as a
+ * coroutine. Each request reads, handles and writes, every step waits for a
+ * simulated I/O completion which is resolved from the event loop below.
+ * Reports the time and the number of heap allocations for each request.
+ *
+ * It needs a C++20 compiler with coroutines, otherwise nothing is measured.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <vector>
+#include "promise-cpp/coroutine.hpp"
+
+static size_t g_allocations = 0;
+
+// Every form of operator new and delete is replaced, all of them take the
+// memory by malloc() and give it back by free(). free() is kept out of line,
+// or GCC takes it as called on the pointer of operator new when inlined.
+#if defined(_MSC_VER)
+#define COUNTED_NOINLINE __declspec(noinline)
+#else
+#define COUNTED_NOINLINE __attribute__((noinline))
+#endif
+
+static void *allocate(size_t size) {
+    ++g_allocations;
+    return malloc(size == 0 ? 1 : size);
+}
+
+COUNTED_NOINLINE static void deallocate(void *ptr) noexcept {
+    free(ptr);
+}
+
+// The pointer from malloc() is stored before the aligned block
+static void *allocateAligned(size_t size, std::align_val_t alignment) {
+    size_t align = static_cast<size_t>(alignment);
+    void *raw = allocate(size + align + sizeof(void *));
+    if (raw == nullptr)
+        return nullptr;
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + sizeof(void *) + align - 1) & ~(uintptr_t)(align - 1);
+    reinterpret_cast<void **>(aligned)[-1] = raw;
+    return reinterpret_cast<void *>(aligned);
+}
+
+static void deallocateAligned(void *ptr) noexcept {
+    if (ptr != nullptr)
+        deallocate(static_cast<void **>(ptr)[-1]);
+}
+
+void *operator new(size_t size) {
+    void *ptr = allocate(size);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    return allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return allocate(size);
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+    void *ptr = allocateAligned(size, alignment);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) {
+    return operator new(size, alignment);
+}
+
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return allocateAligned(size, alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return allocateAligned(size, alignment);
+}
+
+void operator delete(void *ptr) noexcept {
+    deallocate(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    deallocate(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    deallocate(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept {
+    deallocate(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+    deallocate(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+    deallocate(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+    deallocateAligned(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+    deallocateAligned(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+    deallocateAligned(ptr);
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept {
+    deallocateAligned(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+    deallocateAligned(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+    deallocateAligned(ptr);
+}
+
+#ifdef PROMISE_COROUTINE
+
+using namespace promise;
+namespace chrono       = std::chrono;
+using     steady_clock = std::chrono::steady_clock;
+
+static const int kSessions = 100;
+static const int kRequests = 2000;
+
+// Pending I/O, completed by runLoop()
+static std::vector<Defer> g_io;
+
+struct Session {
+    Session() : requests_(0), close_(false) {}
+    int  requests_;
+    bool close_;
+};
+
+Promise asyncOperation() {
+    return newPromise([](Defer &defer) {
+        g_io.push_back(defer);
+    });
+}
+
+Promise asyncRead(const std::shared_ptr<Session> &session) {
+    (void)session;
+    return asyncOperation();
+}
+
+Promise handleRequest(const std::shared_ptr<Session> &session) {
+    if (++session->requests_ >= kRequests)
+        session->close_ = true;
+    return asyncOperation();    // write the response
+}
+
+void runLoop() {
+    std::vector<Defer> io;
+    while (!g_io.empty()) {
+        io.swap(g_io);
+        for (Defer &defer : io)
+            defer.resolve();
+        io.clear();
+    }
+}
+
+// As do_session() in asio_http_server.cpp
+void callbackSession(std::shared_ptr<Session> session) {
+    doWhile([=](DeferLoop &loop) {
+        asyncRead(session)
+        .then([=]() {
+            return handleRequest(session);
+        }).then([]() {
+            return 0;
+        }, [](int err) {
+            return err;
+        }).then([=](int err) {
+            if (!err && !session->close_)
+                loop.doContinue();
+            else
+                loop.doBreak();
+        });
+    });
+}
+
+Promise coroutineSession(std::shared_ptr<Session> session) {
+    while (!session->close_) {
+        try {
+            co_await asyncRead(session);
+            co_await handleRequest(session);
+        }
+        catch (...) {
+            break;
+        }
+    }
+}
+
+// co_return with a value, by a coroutine returning typed::Promise<T>
+typed::Promise<int> length(Promise str) {
+    any value = co_await str;
+    co_return (int)value.cast<std::string>().size();
+}
+
+Promise ignore(Promise str) {
+    co_await str;
+    co_return;
+}
+
+int test_co_return() {
+    int size = 0;
+    bool resolved = false;
+    Promise(length(resolve(std::string("hello")))).then([&size](int value) {
+        size = value;
+    });
+    ignore(resolve(std::string("hello"))).then([&resolved]() {
+        resolved = true;
+    });
+    if (size != 5 || !resolved) {
+        std::cout << "ERROR: co_return resolves " << size << ", " << resolved << std::endl;
+        return 1;
+    }
+    std::cout << "co_return resolves the value" << std::endl;
+    return 0;
+}
+
+template<typename SESSION>
+void test_session(const std::string &name, SESSION &&session) {
+    size_t allocations = g_allocations;
+    steady_clock::time_point start = steady_clock::now();
+    for (int i = 0; i < kSessions; ++i)
+        session(std::make_shared<Session>());
+    runLoop();
+    steady_clock::time_point end = steady_clock::now();
+    allocations = g_allocations - allocations;
+
+    int n = kSessions * kRequests;
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(end - start);
+    std::cout << name << "    " << n << "      " <<
+        ns.count() / n << "ns/op    " <<
+        (double)allocations / n << " allocs/op" << std::endl;
+}
+
+int main() {
+    test_session("BenchmarkCallback", callbackSession);
+    test_session("BenchmarkCoroutine", coroutineSession);
+    return test_co_return();
+}
+
+#else
+
+int main() {
+    std::cout << "C++20 coroutine is not supported by the compiler" << std::endl;
+    return 0;
+}
+
+#endif
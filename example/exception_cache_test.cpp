@@ -0,0 +1,164 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Matching of the rejections from thrown exceptions, which are looked up
+ * once and then cast for each handler type by a cache. Built with the cache
+ * (PROMISE_EXCEPTION_CACHE=1, by default on GCC and Clang) and without it,
+ * the handlers must get the same objects.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+
+static int g_failures = 0;
+
+void check(bool ok, const std::string &what) {
+    std::cout << (ok ? "OK: " : "ERROR: ") << what << std::endl;
+    if (!ok) ++g_failures;
+}
+
+// std::runtime_error is not at the start of the object
+struct tagged {
+    virtual ~tagged() {}
+    int tag_ = 7;
+};
+
+struct tagged_error : public tagged, public std::runtime_error {
+    explicit tagged_error(const std::string &what)
+        : std::runtime_error(what) {
+    }
+};
+
+// The address of the thrown object, as each handler type
+struct thrown {
+    const tagged_error *object_;
+    const std::runtime_error *runtime_;
+    const std::exception *exception_;
+    const tagged *tagged_;
+};
+
+thrown addressOf(const std::exception_ptr &ptr) {
+    try {
+        std::rethrow_exception(ptr);
+    }
+    catch (const tagged_error &ex) {
+        thrown result = { &ex, &ex, &ex, &ex };
+        return result;
+    }
+    catch (...) {
+    }
+    thrown none = { nullptr, nullptr, nullptr, nullptr };
+    return none;
+}
+
+Promise rejected(const std::exception_ptr &ptr) {
+    return newPromise([ptr](Defer &defer) {
+        defer.reject(ptr);
+    });
+}
+
+// One rejection is matched by the handlers of several types in turn
+void test_handler_types() {
+    std::exception_ptr ptr = std::make_exception_ptr(tagged_error("reset"));
+    thrown expected = addressOf(ptr);
+    int matched = 0;
+    for (int round = 0; round < 2; ++round) {
+        rejected(ptr).fail([&](const std::logic_error &) {
+            check(false, "logic_error handler skipped");
+        }).fail([&](const std::runtime_error &ex) {
+            matched += (&ex == expected.runtime_ && std::string(ex.what()) == "reset");
+        });
+        rejected(ptr).fail([&](const tagged &ex) {
+            matched += (&ex == expected.tagged_ && ex.tag_ == 7);
+        });
+        rejected(ptr).fail([&](const tagged_error &ex) {
+            matched += (&ex == expected.object_);
+        });
+        rejected(ptr).fail([&](const std::exception &ex) {
+            matched += (&ex == expected.exception_);
+        });
+        rejected(ptr).fail([&](const std::exception_ptr &arg) {
+            matched += (arg == ptr);
+        });
+    }
+    check(matched == 10, "one thrown exception is matched by each handler type");
+}
+
+// One handler type against several thrown types, alternating
+void test_thrown_types() {
+    std::vector<std::exception_ptr> ptrs = {
+        std::make_exception_ptr(std::logic_error("logic")),
+        std::make_exception_ptr(tagged_error("tagged")),
+        std::make_exception_ptr(std::runtime_error("runtime")),
+        std::make_exception_ptr(42)
+    };
+    std::string matched;
+    for (int round = 0; round < 2; ++round) {
+        for (const std::exception_ptr &ptr : ptrs) {
+            rejected(ptr).fail([&](const std::runtime_error &ex) {
+                matched += std::string(ex.what()) + " ";
+            }).fail([&](const std::exception &ex) {
+                matched += std::string("exception:") + ex.what() + " ";
+            }).fail([&](int value) {
+                matched += std::to_string(value) + " ";
+            });
+        }
+    }
+    check(matched == "exception:logic tagged runtime 42 exception:logic tagged runtime 42 ",
+          "each thrown type is matched by its own handler");
+}
+
+// The exception_ptr itself is taken by a handler of exception_ptr, whether
+// a handler before looked it up or not
+void test_exception_ptr() {
+    std::exception_ptr ptr = std::make_exception_ptr(std::runtime_error("ptr"));
+    int matched = 0;
+    rejected(ptr).fail([&](const std::exception_ptr &arg) {
+        matched += (arg == ptr);
+    });
+    rejected(ptr).fail([&](const std::logic_error &) {
+        check(false, "logic_error handler skipped");
+    }).fail([&](std::exception_ptr arg) {
+        matched += (arg == ptr);
+    });
+    check(matched == 2, "a handler of std::exception_ptr takes the rejection as is");
+}
+
+int main() {
+    std::cout << "PROMISE_EXCEPTION_CACHE = " << PROMISE_EXCEPTION_CACHE << std::endl;
+    test_handler_types();
+    test_thrown_types();
+    test_exception_ptr();
+    return g_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * Continuations resolved in a worker thread are run in the Service thread
+ * by then(executor, ...), fail(executor, ...) and via(executor). The last
+ * test measures the thread hops, which the Service runs in batches.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <thread>
+#include "promise-cpp/promise.hpp"
+#include "add_ons/simple_task/simple_task.hpp"
+
+using namespace promise;
+namespace chrono       = std::chrono;
+using     steady_clock = std::chrono::steady_clock;
+
+static const int N = 100000;
+
+void dump(std::string name, int n,
+    steady_clock::time_point start,
+    steady_clock::time_point end)
+{
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(end - start);
+    std::cout << name << "    " << n << "      " <<
+        ns.count() / n <<
+        "ns/op" << std::endl;
+}
+
+void check(bool ok, const std::string &what) {
+    std::cout << (ok ? "OK: " : "ERROR: ") << what << std::endl;
+}
+
+// Resolve or reject in a new thread
+Promise inThread(bool resolved, int value) {
+    return newPromise([=](Defer &defer) {
+        std::thread([=]() {
+            if (resolved) defer.resolve(value);
+            else defer.reject(value);
+        }).detach();
+    });
+}
+
+Promise test_then(Service &io, std::thread::id ioThread) {
+    return inThread(true, 1).then(io.executor(), [=](int value) {
+        check(value == 1 && std::this_thread::get_id() == ioThread, "then(executor) runs in io thread");
+        return inThread(false, 2);
+    }).fail(io.executor(), [=](const std::string &) {
+        check(false, "fail(executor) skips not matched handler");
+    }).fail(io.executor(), [=](int value) {
+        check(value == 2 && std::this_thread::get_id() == ioThread, "fail(executor) runs in io thread");
+        return value + 1;
+    }).then(inlineExecutor(), [=](int value) {
+        check(value == 3 && std::this_thread::get_id() == ioThread, "then(inlineExecutor) stays in io thread");
+        return inThread(true, 4);
+    }).via(io.executor()).then([=](int value) {
+        check(value == 4 && std::this_thread::get_id() == ioThread, "via(executor) moves the chain to io thread");
+    });
+}
+
+Promise test_hops(Service &io, std::thread::id ioThread) {
+    steady_clock::time_point start = steady_clock::now();
+    return newPromise([=, &io](Defer &defer) {
+        std::thread([=, &io]() {
+            int *count = new int(0);
+            for (int i = 0; i < N; ++i) {
+                resolve(i).then(io.executor(), [=](int) {
+                    if (std::this_thread::get_id() != ioThread)
+                        check(false, "hop to io thread");
+                    if (++*count == N) {
+                        delete count;
+                        defer.resolve();
+                    }
+                });
+            }
+        }).detach();
+    }).then([=]() {
+        steady_clock::time_point end = steady_clock::now();
+        dump("BenchmarkExecutorHop", N, start, end);
+    });
+}
+
+// The executor destroys the posted function without running it
+void test_dropped() {
+    Executor dropping([](Executor::Function &&) {});
+    bool called = false, rejected = false;
+    resolve(1).then(dropping, [&](int) {
+        called = true;
+    }).fail([&](const cancelled_error &) {
+        rejected = true;
+    });
+    check(!called && rejected, "dropped continuation is rejected");
+}
+
+// The service is stopped with a continuation posted to it, which is
+// destroyed when run() returns
+void test_stopped() {
+    Service io;
+    bool called = false, rejected = false;
+    resolve(1).then(io.executor(), [&](int) {
+        called = true;
+    }).fail([&](const cancelled_error &) {
+        rejected = true;
+    });
+    io.stop();
+    io.run();
+    check(!called && rejected, "continuation of stopped service is rejected");
+}
+
+int main() {
+    test_dropped();
+    test_stopped();
+
+    Service io;
+    std::thread::id ioThread = std::this_thread::get_id();
+    io.setAutoStop(false);
+
+    test_then(io, ioThread).then([&]() {
+        return test_hops(io, ioThread);
+    }).then([&]() {
+        io.stop();
+    }, [&]() {
+        check(false, "executor test");
+        io.stop();
+    });
+
+    io.run();
+    return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Dispatch of a rejection to the typed fail() handlers. A handler whose
+ * parameters do not match the rejection is skipped, and the rejection goes
+ * on to the next one.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <system_error>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+
+static int g_failures = 0;
+
+void check(bool ok, const std::string &what) {
+    std::cout << (ok ? "OK: " : "ERROR: ") << what << std::endl;
+    if (!ok) ++g_failures;
+}
+
+void test_exception_type() {
+    std::string matched;
+    newPromise([](Defer &defer) {
+        defer.reject(std::make_exception_ptr(std::runtime_error("reset")));
+    }).fail([&](const std::logic_error &) {
+        matched += "logic_error ";
+    }).fail([&](const std::runtime_error &error) {
+        matched += std::string("runtime_error:") + error.what();
+    }).fail([&](const std::exception &) {
+        matched += " exception";
+    });
+    check(matched == "runtime_error:reset", "fail() takes the handler of the thrown exception type");
+}
+
+void test_error_code() {
+    std::error_code code;
+    bool other = false;
+    newPromise([](Defer &defer) {
+        defer.reject(std::make_error_code(std::errc::connection_reset));
+    }).fail([&](const std::string &) {
+        other = true;
+    }).fail([&](const std::runtime_error &) {
+        other = true;
+    }).fail([&](const std::error_code &error) {
+        code = error;
+    });
+    check(!other && code == std::errc::connection_reset, "fail() takes the handler of std::error_code");
+}
+
+void test_fall_through() {
+    int skipped = 0;
+    bool resolved = false;
+    std::string reason;
+    newPromise([](Defer &defer) {
+        defer.reject(std::string("closed"));
+    }).fail([&](int) {
+        ++skipped;
+    }).then([&]() {
+        resolved = true;
+    }).fail([&](const std::error_code &) {
+        ++skipped;
+    }).fail([&](const std::string &arg) {
+        reason = arg;
+    }).then([&]() {
+        resolved = true;
+    });
+    check(skipped == 0 && reason == "closed", "mismatched fail() handlers fall through to the matched one");
+    check(resolved, "the matched fail() handler resolves the chain");
+}
+
+void test_multiple_arguments() {
+    std::string matched;
+    newPromise([](Defer &defer) {
+        defer.reject(404, std::string("not found"));
+    }).fail([&](const std::string &) {
+        matched += "string ";
+    }).fail([&](int, int) {
+        matched += "int,int ";
+    }).fail([&](int code, const std::string &message) {
+        matched += std::to_string(code) + " " + message;
+    });
+    check(matched == "404 not found", "fail() takes the handler of all the rejected arguments");
+
+    int code = 0;
+    newPromise([](Defer &defer) {
+        defer.reject(500, std::string("internal"));
+    }).fail([&](int arg) {
+        code = arg;
+    });
+    check(code == 500, "fail() takes a handler of the leading rejected arguments");
+}
+
+int main() {
+    test_exception_type();
+    test_error_code();
+    test_fall_through();
+    test_multiple_arguments();
+    return g_failures == 0 ? 0 : 1;
+}
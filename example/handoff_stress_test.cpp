@@ -0,0 +1,143 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Stress benchmark of the hand-off in call(): many threads chain handlers
+ * on a few shared promises and resolve them at the same time. A thread
+ * which finds the tasks in front waiting calls them itself, so no thread
+ * blocks, and the handlers chained by a thread are called in its order.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+namespace chrono       = std::chrono;
+using     steady_clock = std::chrono::steady_clock;
+
+static const int kPerThread = 20000;
+
+void dump(std::string name, int n,
+    steady_clock::time_point start,
+    steady_clock::time_point end)
+{
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(end - start);
+    std::cout << name << "    " << n << "      " <<
+        ns.count() / n <<
+        "ns/op" << std::endl;
+}
+
+// Handlers of one promise are never called at the same time, so the log
+// of a promise is written without lock
+struct Shared {
+    Promise promise_;
+    std::vector<int> log_;  // thread * kPerThread + sequence
+};
+
+bool test_shared(int threads, int shares) {
+    std::vector<Shared> shared(shares);
+    for (Shared &item : shared) {
+        item.promise_ = newPromise();
+        item.log_.reserve(threads * kPerThread / shares + 1);
+    }
+
+    std::atomic<int> finished(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> workers;
+
+    steady_clock::time_point start = steady_clock::now();
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            while (!go) std::this_thread::yield();
+            for (int i = 0; i < kPerThread; ++i) {
+                Shared &item = shared[(i + t) % shares];
+                int id = t * kPerThread + i;
+                item.promise_.then([&item, &finished, id]() -> any {
+                    item.log_.push_back(id);
+                    ++finished;
+                    // Join a returned promise now and then
+                    if (id % 16 == 0)
+                        return resolve(id);
+                    return id;
+                });
+                // Resolved once, as resolve() of a chain settles the task in front
+                if (t == 0 && i == kPerThread / 2) {
+                    for (Shared &each : shared)
+                        each.promise_.resolve(id);
+                }
+            }
+        });
+    }
+
+    go = true;
+    for (auto &worker : workers)
+        worker.join();
+    steady_clock::time_point end = steady_clock::now();
+
+    bool ok = true;
+    int total = threads * kPerThread;
+    if (finished != total) {
+        std::cout << "ERROR: finished = " << finished << ", expected " << total << std::endl;
+        ok = false;
+    }
+    for (Shared &item : shared) {
+        std::vector<int> last(threads, -1);
+        for (int id : item.log_) {
+            int t = id / kPerThread;
+            if (id <= last[t]) {
+                std::cout << "ERROR: handlers of thread " << t << " are called out of order" << std::endl;
+                ok = false;
+                break;
+            }
+            last[t] = id;
+        }
+    }
+    dump("BenchmarkHandoff_" + std::to_string(threads) + "threads_" + std::to_string(shares) + "promises",
+        total, start, end);
+    return ok;
+}
+
+int main() {
+    unsigned int cores = std::thread::hardware_concurrency();
+    if (cores < 2) cores = 2;
+
+    bool ok = true;
+    for (int round = 0; round < 3; ++round) {
+        for (unsigned int threads = 2; threads <= cores * 4; threads *= 2) {
+            ok = test_shared((int)threads, 1) && ok;
+            ok = test_shared((int)threads, 16) && ok;
+        }
+    }
+    std::cout << (ok ? "PASS" : "FAIL") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,99 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Cost of a loop written by returning a new promise from the handler, each
+ * iteration joins the returned promise to the chain. The cost per iteration
+ * should not grow with the count of iterations, even if the promises of all
+ * the iterations are kept by the caller.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+namespace chrono       = std::chrono;
+using     steady_clock = std::chrono::steady_clock;
+
+void dump(std::string name, int n,
+    steady_clock::time_point start,
+    steady_clock::time_point end)
+{
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(end - start);
+    std::cout << name << "    " << n << "      " <<
+        ns.count() / n <<
+        "ns/op" << std::endl;
+}
+
+// Resolved later by the main loop, as an io loop does
+static std::deque<Defer> g_pending;
+
+Promise loop(int n, std::vector<Promise> *kept) {
+    Promise promise = newPromise([](Defer &d) {
+        g_pending.push_back(d);
+    }).then([n, kept]() -> any {
+        if (n == 0) return nullptr;
+        return loop(n - 1, kept);
+    });
+    if (kept != nullptr)
+        kept->push_back(promise);
+    return promise;
+}
+
+void test_join_loop(int n, bool keep) {
+    int finished = 0;
+    std::vector<Promise> kept;
+    steady_clock::time_point start = steady_clock::now();
+    Promise promise = loop(n, keep ? &kept : nullptr).then([&finished]() {
+        ++finished;
+    });
+    while (!g_pending.empty()) {
+        Defer d = g_pending.front();
+        g_pending.pop_front();
+        d.resolve();
+    }
+    steady_clock::time_point end = steady_clock::now();
+
+    if (finished != 1)
+        std::cout << "ERROR: finished = " << finished << ", expected 1" << std::endl;
+    dump(std::string(keep ? "BenchmarkJoinLoopKept_" : "BenchmarkJoinLoop_") + std::to_string(n), n, start, end);
+}
+
+int main() {
+    for (int round = 0; round < 3; ++round) {
+        for (int n : { 1000, 10000, 100000 }) {
+            test_join_loop(n, false);
+            test_join_loop(n, true);
+        }
+    }
+    return 0;
+}
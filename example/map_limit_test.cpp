@@ -0,0 +1,175 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * 10^5 simulated requests started by all() at once, and by mapLimit() and
+ * forEachLimit() with at most 64 in flight. A request is a promise resolved
+ * later by the pump of a simple queue, as a socket read would be.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <memory>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+namespace chrono       = std::chrono;
+using     steady_clock = std::chrono::steady_clock;
+
+// Requests in flight, resolved in the order they were started
+struct Requests {
+    std::deque<std::pair<Promise, int>> pending_;
+    size_t peak_ = 0;
+
+    Promise start(int item) {
+        Promise promise = newPromise();
+        pending_.emplace_back(promise, item);
+        if (pending_.size() > peak_)
+            peak_ = pending_.size();
+        return promise;
+    }
+
+    void pump() {
+        while (!pending_.empty()) {
+            std::pair<Promise, int> request = pending_.front();
+            pending_.pop_front();
+            request.first.resolve(request.second * 2);
+        }
+    }
+};
+
+void dump(std::string name, int n, size_t peak,
+    steady_clock::time_point start,
+    steady_clock::time_point end)
+{
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(end - start);
+    std::cout << name << "    " << n << "      " <<
+        ns.count() / n << "ns/op    peak " << peak << " in flight" << std::endl;
+}
+
+bool checkSum(const std::vector<any> &values, int n) {
+    long long sum = 0;
+    for (const any &value : values)
+        sum += value.cast<int>();
+    return values.size() == (size_t)n && sum == (long long)n * (n - 1);
+}
+
+int test_all(const std::vector<int> &items) {
+    int n = (int)items.size();
+    Requests requests;
+    bool ok = false;
+    steady_clock::time_point start = steady_clock::now();
+    std::vector<Promise> promises;
+    promises.reserve(items.size());
+    for (int item : items)
+        promises.push_back(requests.start(item));
+    all(promises).then([&ok, n](const std::vector<any> &values) {
+        ok = checkSum(values, n);
+    });
+    requests.pump();
+    steady_clock::time_point end = steady_clock::now();
+
+    dump("BenchmarkAll", n, requests.peak_, start, end);
+    if (!ok) std::cout << "ERROR: wrong values of all()" << std::endl;
+    return ok ? 0 : 1;
+}
+
+int test_map_limit(const std::vector<int> &items, size_t limit) {
+    int n = (int)items.size();
+    Requests requests;
+    bool ok = false;
+    steady_clock::time_point start = steady_clock::now();
+    mapLimit(items, limit, [&requests](int item) {
+        return requests.start(item);
+    }).then([&ok, n](const std::vector<any> &values) {
+        ok = checkSum(values, n);
+    });
+    requests.pump();
+    steady_clock::time_point end = steady_clock::now();
+
+    dump("BenchmarkMapLimit_" + std::to_string(limit), n, requests.peak_, start, end);
+    if (!ok || requests.peak_ > limit) std::cout << "ERROR: wrong values of mapLimit()" << std::endl;
+    return (ok && requests.peak_ <= limit) ? 0 : 1;
+}
+
+int test_for_each_limit(const std::vector<int> &items, size_t limit) {
+    int n = (int)items.size();
+    Requests requests;
+    long long sum = 0;
+    bool ok = false;
+    steady_clock::time_point start = steady_clock::now();
+    forEachLimit(items, limit, [&requests, &sum](int item) {
+        return requests.start(item).then([&sum](int value) {
+            sum += value;
+        });
+    }).then([&]() {
+        ok = (sum == (long long)n * (n - 1));
+    });
+    requests.pump();
+    steady_clock::time_point end = steady_clock::now();
+
+    dump("BenchmarkForEachLimit_" + std::to_string(limit), n, requests.peak_, start, end);
+    if (!ok || requests.peak_ > limit) std::cout << "ERROR: wrong values of forEachLimit()" << std::endl;
+    return (ok && requests.peak_ <= limit) ? 0 : 1;
+}
+
+// The requests are never pumped, so mapLimit() is abandoned in flight
+int test_abandoned() {
+    std::shared_ptr<int> tracker = std::make_shared<int>(0);
+    std::weak_ptr<int> observer = tracker;
+    {
+        Requests requests;
+        mapLimit(8, 4, [&requests](size_t index) {
+            return requests.start((int)index);
+        }).then([tracker]() {});
+        tracker.reset();
+    }
+    if (!observer.expired()) {
+        std::cout << "ERROR: abandoned mapLimit() is not released" << std::endl;
+        return 1;
+    }
+    std::cout << "abandoned mapLimit() is released" << std::endl;
+    return 0;
+}
+
+int main() {
+    std::vector<int> items(100000);
+    for (size_t i = 0; i < items.size(); ++i)
+        items[i] = (int)i;
+
+    int errors = test_all(items);
+    errors += test_map_limit(items, 64);
+    errors += test_for_each_limit(items, 64);
+    // one by one
+    errors += test_map_limit(items, 1);
+    errors += test_abandoned();
+    return errors;
+}
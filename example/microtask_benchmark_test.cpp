@@ -0,0 +1,110 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * Throughput of a chain which is resolved synchronously link by link, with
+ * continuations called recursively (default) or from the microtask queue.
+ * 10M links are run in chains of 10000 links in both modes, as a recursive
+ * chain much longer than that overflows the stack. The microtask mode then
+ * runs one chain of 10M links.
+ * doWhile() is measured at last, it loops without creating a chain.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <chrono>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+namespace chrono       = std::chrono;
+using     steady_clock = std::chrono::steady_clock;
+
+static const int N = 10000000;
+static const int kShortChain = 10000;
+
+void dump(std::string name, int n,
+    steady_clock::time_point start,
+    steady_clock::time_point end)
+{
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(end - start);
+    std::cout << name << "    " << n << "      " <<
+        ns.count() / n <<
+        "ns/op" << std::endl;
+}
+
+// Each link returns the promise of next link from its handler
+Promise nextLink(int &n, int links) {
+    return resolve().then([&n, links]() -> Promise {
+        if (++n >= links) return resolve(n);
+        return nextLink(n, links);
+    });
+}
+
+int runChain(int links) {
+    int n = 0;
+    int result = 0;
+    nextLink(n, links).then([&result](int value) {
+        result = value;
+    });
+    return result;
+}
+
+void test_do_while(const std::string &name) {
+    int n = 0;
+    int result = 0;
+    steady_clock::time_point start = steady_clock::now();
+    doWhile([&n](DeferLoop &loop) {
+        if (++n >= N) loop.doBreak(n);
+        else loop.doContinue();
+    }).then([&result](int value) {
+        result = value;
+    });
+    steady_clock::time_point end = steady_clock::now();
+    if (result != N)
+        std::cout << "ERROR: loop is not finished" << std::endl;
+    dump(name, N, start, end);
+}
+
+void test_chains(const std::string &name, bool microtask, int links) {
+    setMicrotaskMode(microtask);
+    steady_clock::time_point start = steady_clock::now();
+    for (int i = 0; i < N / links; ++i) {
+        if (runChain(links) != links)
+            std::cout << "ERROR: chain is not finished" << std::endl;
+    }
+    steady_clock::time_point end = steady_clock::now();
+    dump(name + "_" + std::to_string(links), N, start, end);
+    setMicrotaskMode(false);
+}
+
+int main() {
+    test_chains("BenchmarkRecursive", false, kShortChain);
+    test_chains("BenchmarkMicrotask", true, kShortChain);
+    test_chains("BenchmarkMicrotask", true, N);
+    test_do_while("BenchmarkDoWhile");
+    return 0;
+}
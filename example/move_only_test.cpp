@@ -0,0 +1,148 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Move-only and copy counted values through then(), fail(), finally(),
+ * race() and all(). None of them may copy the value.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+
+static int g_failures = 0;
+
+void check(bool ok, const std::string &what) {
+    std::cout << (ok ? "OK: " : "ERROR: ") << what << std::endl;
+    if (!ok) ++g_failures;
+}
+
+// Counts the copies, a moved body is not counted
+struct Body {
+    static int copies_;
+
+    explicit Body(const std::string &text)
+        : text_(text) {
+    }
+    Body(const Body &other)
+        : text_(other.text_) {
+        ++copies_;
+    }
+    Body(Body &&other) noexcept
+        : text_(std::move(other.text_)) {
+    }
+
+    std::string text_;
+};
+
+int Body::copies_ = 0;
+
+void test_then_finally() {
+    int finally = 0, got = 0, failed = 0;
+    newPromise([](Defer &defer) {
+        defer.resolve(std::unique_ptr<int>(new int(42)));
+    }).then([](std::unique_ptr<int> value) {
+        *value += 1;
+        return value;
+    }).finally([&finally]() {
+        ++finally;
+    }).then([&got](std::unique_ptr<int> value) {
+        got = *value;
+    }).fail([&failed]() {
+        ++failed;
+    });
+    check(finally == 1 && got == 43 && failed == 0, "unique_ptr resolved through then() and finally()");
+}
+
+void test_fail_finally() {
+    int finally = 0, got = 0;
+    newPromise([](Defer &defer) {
+        defer.reject(std::unique_ptr<int>(new int(7)));
+    }).finally([&finally]() {
+        ++finally;
+    }).fail([&got](std::unique_ptr<int> reason) {
+        got = *reason;
+    });
+    check(finally == 1 && got == 7, "unique_ptr rejected through finally() and fail()");
+}
+
+void test_race() {
+    int got = 0;
+    Promise first = newPromise();
+    Promise second = newPromise();
+    race(std::list<Promise>{ first, second }).then([&got](std::unique_ptr<int> value) {
+        got = *value;
+    });
+    second.resolve(std::unique_ptr<int>(new int(2)));
+    first.resolve(std::unique_ptr<int>(new int(1)));
+    check(got == 2, "unique_ptr resolved through race()");
+}
+
+void test_all() {
+    int got = 0;
+    Promise first = newPromise();
+    Promise second = newPromise();
+    all(std::vector<Promise>{ first, second }).fail([&got](std::unique_ptr<int> reason) {
+        got = *reason;
+    });
+    first.reject(std::unique_ptr<int>(new int(3)));
+    check(got == 3, "unique_ptr rejected through all()");
+}
+
+void test_no_copy() {
+    Body::copies_ = 0;
+    std::string got;
+    newPromise([](Defer &defer) {
+        defer.resolve(Body(std::string(1000, 'x')));
+    }).then([](Body body) {
+        return body;
+    }).finally([]() {
+    }).then([](const Body &body) {
+        return newPromise([&body](Defer &defer) {
+            defer.reject(Body(body.text_));
+        });
+    }).finally([]() {
+    }).fail([&got](Body body) {
+        got = std::move(body.text_);
+    });
+    check(Body::copies_ == 0 && got.size() == 1000, "body moved through then(), finally() and fail() without copying");
+}
+
+int main() {
+    test_then_finally();
+    test_fail_finally();
+    test_race();
+    test_all();
+    test_no_copy();
+    return g_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,144 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Multi-producer benchmark: worker threads resolve promises while the main
+ * thread is chaining on the same promises. And the io thread benchmark: the
+ * main thread chains and resolves its own promises, and a worker resolves
+ * a few of them, with and without thread affine mode.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+namespace chrono       = std::chrono;
+using     steady_clock = std::chrono::steady_clock;
+
+static const int N = 200000;
+
+void dump(std::string name, int n,
+    steady_clock::time_point start,
+    steady_clock::time_point end)
+{
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(end - start);
+    std::cout << name << "    " << n << "      " <<
+        ns.count() / n <<
+        "ns/op" << std::endl;
+}
+
+// Each promise is resolved by one producer, and also resolved again by
+// another producer which is expected to be ignored (as the loser in race).
+void test_producers(int producers) {
+    std::vector<Promise> promises;
+    promises.reserve(N);
+    for (int i = 0; i < N; ++i)
+        promises.push_back(newPromise());
+
+    std::atomic<int> finished(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+
+    steady_clock::time_point start = steady_clock::now();
+    for (int t = 0; t < producers; ++t) {
+        threads.emplace_back([&, t]() {
+            while (!go) std::this_thread::yield();
+            for (int i = t; i < N; i += producers) {
+                promises[i].resolve(i);
+                promises[(i + 1) % N].resolve(i);
+            }
+        });
+    }
+
+    go = true;
+    for (int i = 0; i < N; ++i) {
+        promises[i].then([&finished](int) {
+            ++finished;
+        });
+    }
+
+    for (auto &thread : threads)
+        thread.join();
+    steady_clock::time_point end = steady_clock::now();
+
+    if (finished != N)
+        std::cout << "ERROR: finished = " << finished << ", expected " << N << std::endl;
+    dump("BenchmarkProducers_" + std::to_string(producers), N, start, end);
+}
+
+// One of "crossEvery" promises is resolved by the worker
+void test_io_thread(bool affine, int crossEvery) {
+    setThreadAffineMode(affine);
+    std::vector<Promise> promises;
+    promises.reserve(N);
+    for (int i = 0; i < N; ++i)
+        promises.push_back(newPromise());
+
+    std::atomic<int> finished(0);
+    steady_clock::time_point start = steady_clock::now();
+    std::thread worker([&promises, crossEvery]() {
+        for (int i = 0; i < N; i += crossEvery)
+            promises[i].resolve(i);
+    });
+    for (int i = 0; i < N; ++i) {
+        promises[i].then([](int value) {
+            return value + 1;
+        }).then([&finished](int) {
+            ++finished;
+        });
+        if (i % crossEvery != 0)
+            promises[i].resolve(i);
+    }
+    worker.join();
+    steady_clock::time_point end = steady_clock::now();
+    setThreadAffineMode(false);
+
+    if (finished != N)
+        std::cout << "ERROR: finished = " << finished << ", expected " << N << std::endl;
+    dump(std::string(affine ? "BenchmarkIoThreadAffine_" : "BenchmarkIoThread_") + std::to_string(crossEvery), N, start, end);
+}
+
+int main() {
+    unsigned int cores = std::thread::hardware_concurrency();
+    if (cores == 0) cores = 2;
+
+    for (int round = 0; round < 3; ++round) {
+        for (unsigned int producers = 1; producers <= cores * 2; producers *= 2)
+            test_producers((int)producers);
+        for (int crossEvery : { 20, 1000 }) {
+            test_io_thread(false, crossEvery);
+            test_io_thread(true, crossEvery);
+        }
+    }
+    return 0;
+}
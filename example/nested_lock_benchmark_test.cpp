@@ -0,0 +1,114 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * Cost of releasing and taking again all levels of a promise Mutex, as done
+ * around every handler call, for a Mutex locked at different depths. And a
+ * chain of handlers, each one resolving the next promise inside it.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <vector>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+namespace chrono       = std::chrono;
+using     steady_clock = std::chrono::steady_clock;
+
+static const int N = 1000000;
+
+void dump(std::string name, int n,
+    steady_clock::time_point start,
+    steady_clock::time_point end)
+{
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(end - start);
+    std::cout << name << "    " << n << "      " <<
+        ns.count() / n <<
+        "ns/op" << std::endl;
+}
+
+#if PROMISE_MULTITHREAD
+void test_release(size_t depth) {
+    Mutex mutex;
+    mutex.lock(depth);
+    steady_clock::time_point start = steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+        size_t lock_count = mutex.lock_count();
+        mutex.unlock(lock_count);
+        mutex.lock(lock_count);
+    }
+    steady_clock::time_point end = steady_clock::now();
+    if (mutex.lock_count() != depth)
+        std::cout << "ERROR: lock_count = " << mutex.lock_count() << ", expected " << depth << std::endl;
+    mutex.unlock(depth);
+    dump("BenchmarkReleaseAll_" + std::to_string(depth), N, start, end);
+}
+#endif
+
+// Handler i resolves promise i + 1, so the resolves are nested "length" deep
+void test_nested_chain(int length) {
+    int rounds = N / length;
+    int called = 0;
+    steady_clock::time_point start = steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        std::vector<Defer> defers;
+        std::vector<Promise> promises;
+        defers.reserve(length);
+        promises.reserve(length);
+        for (int i = 0; i < length; ++i) {
+            promises.push_back(newPromise([&defers](Defer &defer) {
+                defers.push_back(defer);
+            }));
+        }
+        for (int i = 0; i < length; ++i) {
+            promises[i].then([&defers, &called, i, length]() {
+                ++called;
+                if (i + 1 < length)
+                    defers[i + 1].resolve();
+            });
+        }
+        defers[0].resolve();
+    }
+    steady_clock::time_point end = steady_clock::now();
+    if (called != rounds * length)
+        std::cout << "ERROR: called = " << called << ", expected " << rounds * length << std::endl;
+    dump("BenchmarkNestedChain_" + std::to_string(length), rounds * length, start, end);
+}
+
+int main() {
+    for (int round = 0; round < 3; ++round) {
+#if PROMISE_MULTITHREAD
+        for (size_t depth : { 1, 2, 8, 64 })
+            test_release(depth);
+#endif
+        for (int length : { 1, 100, 1000 })
+            test_nested_chain(length);
+    }
+    return 0;
+}
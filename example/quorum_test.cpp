@@ -0,0 +1,202 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Quorum read from 5 replicas by some(), anyOf() and allSettled(). The
+ * replies are delivered in the order of latency by a simulated network,
+ * and the replicas still pending once the quorum is met are cancelled.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <functional>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+namespace chrono       = std::chrono;
+using     steady_clock = std::chrono::steady_clock;
+
+struct Reply {
+    int         latency_;
+    bool        ok_;
+    Promise     promise_;
+};
+
+// Replies which are not delivered yet
+struct Network {
+    std::vector<Reply> replies_;
+    int cancelled_ = 0;
+
+    Promise read(int latency, bool ok) {
+        Promise promise = newPromise([this](Defer &defer) {
+            defer.onCancel([this]() { ++cancelled_; });
+        });
+        replies_.push_back(Reply{ latency, ok, promise });
+        return promise;
+    }
+
+    void deliver() {
+        std::stable_sort(replies_.begin(), replies_.end(), [](const Reply &a, const Reply &b) {
+            return a.latency_ < b.latency_;
+        });
+        for (Reply &reply : replies_) {
+            if (reply.ok_)
+                reply.promise_.resolve(reply.latency_);
+            else
+                reply.promise_.reject(std::string("replica down"));
+        }
+        replies_.clear();
+    }
+};
+
+// latency of each replica, negative for a replica which is down
+static const int latencies[] = { 30, -10, 20, 50, -40 };
+
+std::vector<Promise> readAll(Network &network) {
+    std::vector<Promise> replicas;
+    for (int i = 0; i < 5; ++i)
+        replicas.push_back(network.read(latencies[i] < 0 ? -latencies[i] : latencies[i], latencies[i] > 0));
+    return replicas;
+}
+
+int test_some() {
+    Network network;
+    int result = -1;
+    some(2, readAll(network), LoserPolicy::kCancel).then([&result](int first, int second) {
+        result = first + second;
+    });
+    network.deliver();
+    if (result != 20 + 30 || network.cancelled_ != 2) {
+        std::cout << "ERROR: some() result = " << result << ", cancelled = " << network.cancelled_ << std::endl;
+        return 1;
+    }
+    std::cout << "some(2, 5): 20 + 30, 2 replicas cancelled" << std::endl;
+    return 0;
+}
+
+int test_some_failed() {
+    Network network;
+    size_t reasons = 0;
+    some(4, readAll(network), LoserPolicy::kCancel).fail([&reasons](const aggregate_error &error) {
+        reasons = error.reasons_.size();
+    });
+    network.deliver();
+    if (reasons != 2 || network.cancelled_ != 1) {
+        std::cout << "ERROR: some() reasons = " << reasons << ", cancelled = " << network.cancelled_ << std::endl;
+        return 1;
+    }
+    std::cout << "some(4, 5): rejected with 2 reasons, 1 replica cancelled" << std::endl;
+    return 0;
+}
+
+int test_any_of() {
+    Network network;
+    int result = -1;
+    anyOf(readAll(network), LoserPolicy::kCancel).then([&result](int latency) {
+        result = latency;
+    });
+    network.deliver();
+    if (result != 20 || network.cancelled_ != 3) {
+        std::cout << "ERROR: anyOf() result = " << result << ", cancelled = " << network.cancelled_ << std::endl;
+        return 1;
+    }
+    std::cout << "anyOf(5): 20, 3 replicas cancelled" << std::endl;
+    return 0;
+}
+
+int test_all_settled() {
+    Network network;
+    int resolved = 0, rejected = 0;
+    allSettled(readAll(network)).then([&](const std::vector<Settled> &results) {
+        for (const Settled &result : results) {
+            if (result.isResolved()) ++resolved;
+            else ++rejected;
+        }
+    });
+    network.deliver();
+    if (resolved != 3 || rejected != 2) {
+        std::cout << "ERROR: allSettled() resolved = " << resolved << ", rejected = " << rejected << std::endl;
+        return 1;
+    }
+    std::cout << "allSettled(5): 3 resolved, 2 rejected" << std::endl;
+    return 0;
+}
+
+// The replies are never delivered, so the quorum is abandoned pending
+bool releasedWhenAbandoned(const std::function<Promise(const std::vector<Promise> &)> &quorum) {
+    std::shared_ptr<int> tracker = std::make_shared<int>(0);
+    std::weak_ptr<int> observer = tracker;
+    {
+        Network network;
+        quorum(readAll(network)).then([tracker]() {});
+        tracker.reset();
+    }
+    return observer.expired();
+}
+
+int test_abandoned() {
+    int errors = 0;
+    if (!releasedWhenAbandoned([](const std::vector<Promise> &replies) { return some(3, replies); })) {
+        std::cout << "ERROR: abandoned some() is not released" << std::endl;
+        ++errors;
+    }
+    if (!releasedWhenAbandoned([](const std::vector<Promise> &replies) { return anyOf(replies); })) {
+        std::cout << "ERROR: abandoned anyOf() is not released" << std::endl;
+        ++errors;
+    }
+    if (!releasedWhenAbandoned([](const std::vector<Promise> &replies) { return allSettled(replies); })) {
+        std::cout << "ERROR: abandoned allSettled() is not released" << std::endl;
+        ++errors;
+    }
+    if (errors == 0)
+        std::cout << "abandoned some(), anyOf() and allSettled() are released" << std::endl;
+    return errors;
+}
+
+void benchmark_some(int n) {
+    steady_clock::time_point start = steady_clock::now();
+    for (int i = 0; i < n; ++i) {
+        Network network;
+        some(2, readAll(network), LoserPolicy::kCancel).then([](int, int) {});
+        network.deliver();
+    }
+    steady_clock::time_point end = steady_clock::now();
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(end - start);
+    std::cout << "BenchmarkSome_2_of_5    " << n << "      " << ns.count() / n << "ns/op" << std::endl;
+}
+
+int main() {
+    int errors = test_some() + test_some_failed() + test_any_of() + test_all_settled()
+        + test_abandoned();
+    benchmark_some(100000);
+    return errors;
+}
@@ -0,0 +1,167 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Lifetime of the promise chain objects, which are reference counted by
+ * IntrusivePtr. The handlers and values are tracked by a shared_ptr, and
+ * must be released as soon as the last handle of their promise is gone.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+
+static int g_failures = 0;
+
+void check(bool ok, const std::string &what) {
+    std::cout << (ok ? "OK: " : "ERROR: ") << what << std::endl;
+    if (!ok) ++g_failures;
+}
+
+// Counts the calls of dispose() and the destructor
+struct Node : public RefCounted<Node> {
+    Node(int *disposed, int *destroyed)
+        : disposed_(disposed)
+        , destroyed_(destroyed) {
+    }
+    ~Node() {
+        ++*destroyed_;
+    }
+    void dispose() {
+        ++*disposed_;
+    }
+    int *disposed_;
+    int *destroyed_;
+};
+
+void test_intrusive() {
+    int disposed = 0, destroyed = 0;
+    IntrusivePtr<Node> strong = makeIntrusive<Node>(&disposed, &destroyed);
+    IntrusivePtr<Node> copy = strong;
+    IntrusiveWeakPtr<Node> weak(strong);
+    strong.reset();
+    check(disposed == 0 && weak.lock().get() == copy.get(), "a weak reference locks a kept object");
+
+    copy.reset();
+    check(disposed == 1 && destroyed == 0 && !weak.lock(), "the last strong reference disposes the object");
+
+    weak.reset();
+    check(destroyed == 1, "the last weak reference frees the object");
+
+    IntrusivePtr<Node> unique = makeIntrusive<Node>(&disposed, &destroyed);
+    unique.reset();
+    check(disposed == 2 && destroyed == 2, "an object without weak references is freed at once");
+}
+
+void test_shared() {
+    int got = 0;
+    Promise promise = newPromise();
+    Promise copy = promise;
+    promise.then([&got](int value) {
+        got = value;
+    });
+    copy.resolve(1);
+    check(got == 1, "copies of a promise share its state");
+}
+
+void test_abandoned() {
+    std::shared_ptr<int> tracker = std::make_shared<int>(0);
+    std::weak_ptr<int> observer = tracker;
+    {
+        Promise promise = newPromise();
+        promise.then([tracker]() {
+        }).then([tracker]() {
+        });
+        tracker.reset();
+        check(!observer.expired(), "a pending promise keeps its handlers");
+    }
+    check(observer.expired(), "an abandoned promise releases its handlers");
+}
+
+void test_defer() {
+    std::shared_ptr<int> tracker = std::make_shared<int>(0);
+    std::weak_ptr<int> observer = tracker;
+    std::vector<Defer> defers;
+    bool called = false;
+    newPromise([&defers](Defer &defer) {
+        defers.push_back(defer);
+    }).then([tracker, &called]() {
+        called = true;
+    });
+    tracker.reset();
+    check(!observer.expired(), "a pending defer keeps its promise");
+
+    defers[0].resolve();
+    check(called && observer.expired(), "the handlers are released once called");
+    defers.clear();
+}
+
+void test_value() {
+    std::shared_ptr<int> tracker = std::make_shared<int>(0);
+    std::weak_ptr<int> observer = tracker;
+    {
+        Promise promise = newPromise();
+        promise.resolve(tracker);
+        tracker.reset();
+        check(!observer.expired(), "a settled promise keeps its value");
+    }
+    check(observer.expired(), "the value is released with the last promise");
+}
+
+void test_joined() {
+    std::shared_ptr<int> tracker = std::make_shared<int>(0);
+    std::weak_ptr<int> observer = tracker;
+    int got = 0;
+    {
+        Promise inner = newPromise();
+        newPromise([](Defer &defer) {
+            defer.resolve();
+        }).then([inner]() {
+            return inner;
+        }).then([tracker, &got](int value) {
+            got = value;
+        });
+        tracker.reset();
+        inner.resolve(2);
+    }
+    check(got == 2 && observer.expired(), "a joined chain is released once done");
+}
+
+int main() {
+    test_intrusive();
+    test_shared();
+    test_abandoned();
+    test_defer();
+    test_value();
+    test_joined();
+    return g_failures == 0 ? 0 : 1;
+}
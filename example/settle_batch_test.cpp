@@ -0,0 +1,213 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * 10^5 defers completed at once, resolved one by one and by SettleBatch,
+ * by one thread and by two producer threads, and the same burst drained
+ * by Service::run(). And a batch whose first defer joins the promise of
+ * the next one to another holder.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "promise-cpp/promise.hpp"
+#include "add_ons/simple_task/simple_task.hpp"
+
+using namespace promise;
+namespace chrono       = std::chrono;
+using     steady_clock = std::chrono::steady_clock;
+
+void dump(std::string name, int n,
+    steady_clock::time_point start,
+    steady_clock::time_point end)
+{
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(end - start);
+    std::cout << name << "    " << n << "      " <<
+        ns.count() / n <<
+        "ns/op" << std::endl;
+}
+
+enum class Settle {
+    kOneByOne,      // Defer::resolve()
+    kResolveAll,    // resolveAll() with one value
+    kBatch          // SettleBatch with a value for each defer
+};
+
+// The defers of each thread
+std::vector<std::vector<Defer>> newDefers(int n, int threads, std::atomic<long long> &sum) {
+    std::vector<std::vector<Defer>> parts(threads);
+    for (int i = 0; i < n; ++i) {
+        std::vector<Defer> &defers = parts[i % threads];
+        newPromise([&defers](Defer &defer) {
+            defers.push_back(defer);
+        }).then([&sum](int value) {
+            sum += value;
+        });
+    }
+    return parts;
+}
+
+void settle(std::vector<Defer> &defers, Settle mode) {
+    if (mode == Settle::kOneByOne) {
+        for (Defer &defer : defers)
+            defer.resolve(1);
+    }
+    else if (mode == Settle::kResolveAll) {
+        resolveAll(defers, 1);
+    }
+    else {
+        SettleBatch batch;
+        batch.reserve(defers.size());
+        for (Defer &defer : defers)
+            batch.resolve(std::move(defer), 1);
+        batch.run();
+    }
+    // The defers are released in the time measured, as a batch releases them
+    defers.clear();
+}
+
+int test_settle(int n, int threads, Settle mode) {
+    static const char *names[] = { "BenchmarkSettleOneByOne_", "BenchmarkResolveAll_", "BenchmarkSettleBatch_" };
+    std::atomic<long long> sum(0);
+    std::vector<std::vector<Defer>> parts = newDefers(n, threads, sum);
+
+    steady_clock::time_point start = steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; ++t) {
+        std::vector<Defer> &defers = parts[t];
+        workers.emplace_back([&defers, mode]() {
+            settle(defers, mode);
+        });
+    }
+    settle(parts[0], mode);
+    for (std::thread &worker : workers)
+        worker.join();
+    steady_clock::time_point end = steady_clock::now();
+
+    dump(names[(int)mode] + std::to_string(threads) + "threads", n, start, end);
+    if (sum != n) {
+        std::cout << "ERROR: " << sum << " of " << n << " resolved" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Resolving dB joins the holder of pA to the one of pR, which has a higher
+// rank, so dA must not be settled on the holder locked for dB.
+int test_joined_in_batch(Settle mode) {
+    static const char *names[] = { "OneByOne", "ResolveAll", "Batch" };
+    std::vector<Defer> others;
+    auto pending = [&others]() {
+        return newPromise([&others](Defer &defer) {
+            others.push_back(defer);
+        });
+    };
+    // Two joins of equal rank make the root of pR rank 2
+    Promise pR = pending();
+    Promise p1 = pending();
+    Promise p2 = pending();
+    Promise p3 = pending();
+    pR.then(p1);
+    p2.then(p3);
+    pR.then(p2);
+
+    std::vector<Defer> defers;
+    Promise pB = newPromise([&defers](Defer &defer) {
+        defers.push_back(defer);
+    });
+    Promise pA = newPromise([&defers](Defer &defer) {
+        defers.push_back(defer);
+    });
+    int result = 0;
+    pB.then([pR]() {
+        return pR;
+    });
+    pB.then(pA);
+    pA.then([&result](int value) {
+        result = value;
+    });
+
+    if (mode == Settle::kOneByOne) {
+        for (Defer &defer : defers)
+            defer.resolve(42);
+    }
+    else if (mode == Settle::kResolveAll) {
+        resolveAll(defers, 42);
+    }
+    else {
+        SettleBatch batch;
+        for (Defer &defer : defers)
+            batch.resolve(defer, 42);
+        batch.run();
+    }
+
+    if (result != 42) {
+        std::cout << "ERROR: joined in batch (" << names[(int)mode] << "), result = " << result << std::endl;
+        return 1;
+    }
+    std::cout << "OK: joined in batch (" << names[(int)mode] << ")" << std::endl;
+    return 0;
+}
+
+int test_service(int n) {
+    Service service;
+    long long sum = 0;
+    for (int i = 0; i < n; ++i) {
+        service.yield().then([&sum]() {
+            ++sum;
+        });
+    }
+
+    steady_clock::time_point start = steady_clock::now();
+    service.run();
+    steady_clock::time_point end = steady_clock::now();
+
+    dump("BenchmarkServiceDrain", n, start, end);
+    if (sum != n) {
+        std::cout << "ERROR: " << sum << " of " << n << " tasks run" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int main() {
+    const int n = 100000;
+    int errors = 0;
+    for (int threads : { 1, 2 }) {
+        errors += test_settle(n, threads, Settle::kOneByOne);
+        errors += test_settle(n, threads, Settle::kResolveAll);
+        errors += test_settle(n, threads, Settle::kBatch);
+    }
+    errors += test_service(n);
+    for (Settle mode : { Settle::kOneByOne, Settle::kResolveAll, Settle::kBatch })
+        errors += test_joined_in_batch(mode);
+    return errors;
+}
@@ -49,6 +49,13 @@ void dump(std::string name, int n,
         "ns/op" << std::endl;
 }
 
+void dumpPool() {
+    PoolStatistics statistics = getPoolStatistics();
+    std::cout << "Pool hits = " << statistics.hits_
+              << ", misses = " << statistics.misses_
+              << ", slabs = " << statistics.slabs_ << std::endl;
+}
+
 void task(Service &io, int task_id, int count, int *pcoro, Defer defer) {
     if (count == 0) {
         -- *pcoro;
@@ -90,6 +97,7 @@ int main() {
 #else
         printf("In while ...\n");
 #endif
+        dumpPool();
         //Sleep(5000);
         test_switch(io, 1).then([&]() {
             return test_switch(io, 1000);
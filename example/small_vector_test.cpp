@@ -0,0 +1,137 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * SmallVector, which keeps the pending tasks of a promise holder, and the
+ * order of the tasks when they spill to heap and when holders are joined.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <memory>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+
+static int g_failures = 0;
+
+void check(bool ok, const std::string &what) {
+    std::cout << (ok ? "OK: " : "ERROR: ") << what << std::endl;
+    if (!ok) ++g_failures;
+}
+
+typedef SmallVector<std::shared_ptr<int>, 2> Vector;
+
+std::string dump(const Vector &vector) {
+    std::string result;
+    for (const std::shared_ptr<int> &item : vector)
+        result += std::to_string(*item);
+    return result;
+}
+
+void fill(Vector &vector, int from, int to) {
+    for (int i = from; i < to; ++i)
+        vector.push_back(std::make_shared<int>(i));
+}
+
+void test_vector() {
+    std::weak_ptr<int> first;
+    {
+        Vector vector;
+        fill(vector, 0, 2);
+        first = vector.front();
+        fill(vector, 2, 5);
+        check(dump(vector) == "01234", "items spill to heap in order");
+
+        vector.pop_front();
+        vector.pop_front();
+        check(first.expired() && dump(vector) == "234", "pop_front() releases the front item");
+
+        fill(vector, 5, 7);
+        check(dump(vector) == "23456", "items are pushed after the popped ones");
+
+        vector.remove_if([](const std::shared_ptr<int> &item) { return *item % 2 == 0; });
+        check(dump(vector) == "35", "remove_if() keeps the order of the others");
+
+        first = vector.front();
+    }
+    check(first.expired(), "the items are released with the vector");
+}
+
+void test_splice() {
+    Vector left, right;
+    fill(right, 0, 4);
+    const std::shared_ptr<int> *data = &right.front();
+    left.splice(right);
+    check(dump(left) == "0123" && right.empty() && &left.front() == data,
+          "splice() to an empty vector takes the heap buffer");
+
+    fill(right, 4, 6);
+    left.splice(right);
+    check(dump(left) == "012345" && right.empty(), "splice() to a vector moves the items after its own");
+
+    fill(right, 6, 7);
+    check(dump(right) == "6", "a spliced vector is used again");
+}
+
+void test_task_order() {
+    std::string order;
+    Promise promise = newPromise();
+    for (int i = 0; i < 5; ++i) {
+        promise.then([&order, i]() {
+            order += std::to_string(i);
+        });
+    }
+    promise.resolve();
+    check(order == "01234", "the tasks of a holder run in order beyond the inline ones");
+}
+
+void test_join_order() {
+    std::string order;
+    Promise inner = newPromise();
+    inner.then([&]() { order += "i1 "; })
+         .then([&]() { order += "i2 "; })
+         .then([&]() { order += "i3 "; });
+
+    Promise outer = newPromise();
+    outer.then([&]() { order += "o1 "; return inner; })
+         .then([&]() { order += "o2 "; })
+         .then([&]() { order += "o3 "; });
+
+    outer.resolve();
+    inner.resolve();
+    check(order == "o1 i1 i2 i3 o2 o3 ", "the tasks of a returned promise run before the rest of the chain");
+}
+
+int main() {
+    test_vector();
+    test_splice();
+    test_task_order();
+    test_join_order();
+    return g_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,99 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Compare the untyped promise with promise::typed::Promise<T> on a chain
+ * of handlers which pass an int and a std::string.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <chrono>
+#include "promise-cpp/promise.hpp"
+#include "promise-cpp/typed_promise.hpp"
+
+namespace chrono       = std::chrono;
+using     steady_clock = std::chrono::steady_clock;
+
+static const int N = 200000;
+
+void dump(std::string name, int n,
+    steady_clock::time_point start,
+    steady_clock::time_point end)
+{
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(end - start);
+    std::cout << name << "    " << n << "      " <<
+        ns.count() / n <<
+        "ns/op" << std::endl;
+}
+
+void test_untyped() {
+    size_t total = 0;
+    steady_clock::time_point start = steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+        promise::Promise defer = promise::newPromise();
+        defer.then([](int value) {
+            return std::to_string(value);
+        }).then([](const std::string &str) {
+            return (int)str.size();
+        }).then([&total](int size) {
+            total += (size_t)size;
+        });
+        defer.resolve(i);
+    }
+    steady_clock::time_point end = steady_clock::now();
+    dump("BenchmarkUntyped", N, start, end);
+    if (total == 0) std::cout << "ERROR: total = 0" << std::endl;
+}
+
+void test_typed() {
+    size_t total = 0;
+    steady_clock::time_point start = steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+        promise::typed::Promise<int> defer = promise::typed::newPromise<int>();
+        defer.then([](int value) {
+            return std::to_string(value);
+        }).then([](const std::string &str) {
+            return (int)str.size();
+        }).then([&total](int size) {
+            total += (size_t)size;
+        });
+        defer.resolve(i);
+    }
+    steady_clock::time_point end = steady_clock::now();
+    dump("BenchmarkTyped", N, start, end);
+    if (total == 0) std::cout << "ERROR: total = 0" << std::endl;
+}
+
+int main() {
+    for (int round = 0; round < 3; ++round) {
+        test_untyped();
+        test_typed();
+    }
+    return 0;
+}
@@ -30,12 +30,27 @@
  */
 #include <vector>
 #include <exception>
+#include <stdexcept>
+#include <typeinfo>
+#include <new>
 #include <utility>
 #include <type_traits>
 #include <tuple>
+#include <cstdint>
 #include "add_ons.hpp"
 #include "call_traits.hpp"
 
+// Match a std::exception_ptr against the handlers by cached type lookup,
+// instead of rethrowing it for each handler. It relies on rethrow_exception
+// rethrowing the same object, as the Itanium C++ ABI does.
+#ifndef PROMISE_EXCEPTION_CACHE
+#   if defined(__cpp_rtti) && (defined(__GLIBCXX__) || defined(_LIBCPP_VERSION))
+#       define PROMISE_EXCEPTION_CACHE 1
+#   else
+#       define PROMISE_EXCEPTION_CACHE 0
+#   endif
+#endif
+
 namespace promise {
 
 // Any library
@@ -48,6 +63,8 @@ namespace promise {
 // where: tested with BCC 5.5, MSVC 6.0, and g++ 2.95
 
 class any;
+class bad_any_cast;
+class bad_any_copy;
 template<typename ValueType>
 inline ValueType any_cast(const any &operand);
 
@@ -59,22 +76,22 @@ public: // structors
 
     template<typename ValueType>
     any(const ValueType &value)
-        : content(new holder<typename std::remove_cvref<ValueType>::type>(value)) {
+        : content(create<typename std::remove_cvref<ValueType>::type>(buffer, value)) {
     }
 
     template<typename RET, typename ...ARG>
     any(RET value(ARG...))
-        : content(new holder<RET (*)(ARG...)>(value)) {
+        : content(create<RET (*)(ARG...)>(buffer, value)) {
     }
 
     any(const any &other)
-        : content(other.content ? other.content->clone() : 0) {
+        : content(other.content ? other.content->clone(buffer) : 0) {
     }
 
     // Move constructor
-    any(any &&other)
-        : content(other.content) {
-        other.content = 0;
+    any(any &&other) noexcept
+        : content(0) {
+        move_from(other);
     }
 
     // Perfect forwarding of ValueType
@@ -82,19 +99,28 @@ public: // structors
     any(ValueType &&value
         , typename std::enable_if<!std::is_same<any &, ValueType>::value>::type* = nullptr // disable if value has type `any&`
         , typename std::enable_if<!std::is_const<ValueType>::value>::type* = nullptr) // disable if value has type `const ValueType&&`
-        : content(new holder<typename std::remove_cvref<ValueType>::type>(static_cast<ValueType &&>(value))) {
+        : content(create<typename std::remove_cvref<ValueType>::type>(buffer, static_cast<ValueType &&>(value))) {
     }
 
     ~any() {
-        if (content != nullptr) {
-            delete(content);
-        }
+        destroy();
     }
 
     any call(const any &arg) const {
         return content ? content->call(arg) : any();
     }
 
+    // The arguments may be moved into the parameters of callable
+    any call(any &&arg) const {
+        return content ? content->call(static_cast<any &&>(arg)) : any();
+    }
+
+    // Check if call(arg) can bind the arguments, no exception is thrown.
+    // A std::exception_ptr is accepted if it may match by catch clause.
+    bool accepts(const any &arg) const {
+        return content ? content->accepts(arg) : true;
+    }
+
     template<typename ValueType,
         typename std::enable_if<!std::is_pointer<ValueType>::value>::type *dummy = nullptr>
     inline ValueType cast() const {
@@ -115,7 +141,11 @@ public: // structors
 public: // modifiers
 
     any & swap(any & rhs) {
-        std::swap(content, rhs.content);
+        if (this != &rhs) {
+            any tmp(std::move(rhs));
+            rhs.move_from(*this);
+            move_from(tmp);
+        }
         return *this;
     }
 
@@ -130,6 +160,14 @@ public: // modifiers
         return *this;
     }
 
+    any & operator=(any && rhs) noexcept {
+        if (this != &rhs) {
+            destroy();
+            move_from(rhs);
+        }
+        return *this;
+    }
+
 public: // queries
     bool empty() const {
         return !content;
@@ -151,8 +189,11 @@ public: // types (public so any_cast can be non-friend)
 
     public: // queries
         virtual type_index type() const = 0;
-        virtual placeholder *clone() const = 0;
+        virtual placeholder *clone(void *buffer) const = 0;
+        virtual placeholder *move(void *buffer) = 0;
         virtual any call(const any &arg) const = 0;
+        virtual any call(any &&arg) const = 0;
+        virtual bool accepts(const any &arg) const = 0;
     };
 
     template<typename ValueType>
@@ -162,26 +203,111 @@ public: // types (public so any_cast can be non-friend)
             : held(value) {
         }
 
+        holder(ValueType && value)
+            : held(static_cast<ValueType &&>(value)) {
+        }
+
     public: // queries
         virtual type_index type() const {
             return type_id<ValueType>();
         }
 
-        virtual placeholder * clone() const {
-            return new holder(held);
+        virtual placeholder * clone(void *buffer) const {
+            return clone(buffer, std::is_copy_constructible<ValueType>());
+        }
+
+        // Called only if the holder is in the inline buffer
+        virtual placeholder * move(void *buffer) {
+            return new (buffer) holder(static_cast<ValueType &&>(held));
         }
 
         virtual any call(const any &arg) const {
             return any_call(held, arg);
         }
+
+        virtual any call(any &&arg) const {
+            return any_call(held, static_cast<any &&>(arg));
+        }
+
+        virtual bool accepts(const any &arg) const {
+            return any_accepts(held, arg);
+        }
+    private:
+        placeholder * clone(void *buffer, std::true_type) const {
+            return create<ValueType>(buffer, held);
+        }
+
+        // The value is move-only
+        placeholder * clone(void *, std::false_type) const {
+            throw bad_any_copy(type_id<ValueType>());
+        }
     public: // representation
         ValueType held;
     private: // intentionally left unimplemented
         holder & operator=(const holder &);
     };
 
+private: // small buffer
+    // Values of nothrow-move types up to 3 pointers, besides the vtable of the
+    // holder, are stored inline, others on heap. It takes the std::vector<any>
+    // of the arguments, which every void resolve() or reject() packs, as well
+    // as Promise, exception_ptr, shared_ptr and small handlers.
+    static const size_t buffer_size = 4 * sizeof(void *);
+
+    template<typename ValueType>
+    struct fits_buffer : std::integral_constant<bool,
+        sizeof(holder<ValueType>) <= buffer_size
+        && alignof(holder<ValueType>) <= alignof(void *)
+        && std::is_nothrow_move_constructible<ValueType>::value> {
+    };
+
+    template<typename ValueType, typename ARG>
+    static placeholder * create(void *buffer, ARG &&value) {
+        return create<ValueType>(buffer, static_cast<ARG &&>(value), fits_buffer<ValueType>());
+    }
+
+    template<typename ValueType, typename ARG>
+    static placeholder * create(void *buffer, ARG &&value, std::true_type) {
+        return new (buffer) holder<ValueType>(static_cast<ARG &&>(value));
+    }
+
+    template<typename ValueType, typename ARG>
+    static placeholder * create(void *, ARG &&value, std::false_type) {
+        return new holder<ValueType>(static_cast<ARG &&>(value));
+    }
+
+    bool is_inline() const {
+        return static_cast<const void *>(content) == static_cast<const void *>(buffer);
+    }
+
+    void destroy() {
+        if (content != nullptr) {
+            if (is_inline())
+                content->~placeholder();
+            else
+                delete(content);
+            content = 0;
+        }
+    }
+
+    // Take the value of other, *this must be empty
+    void move_from(any &other) noexcept {
+        if (other.content == nullptr)
+            return;
+        if (other.is_inline()) {
+            content = other.content->move(buffer);
+            other.destroy();
+        }
+        else {
+            content = other.content;
+            other.content = 0;
+        }
+    }
+
 public: // representation (public so any_cast can be non-friend)
     placeholder * content;
+private:
+    alignas(void *) unsigned char buffer[buffer_size];
 };
 
 class bad_any_cast : public std::bad_cast {
@@ -198,6 +324,17 @@ public:
     }
 };
 
+// Thrown by copying an any which holds a move-only value, the type of the
+// value is known only at run time.
+class bad_any_copy : public std::logic_error {
+public:
+    type_index type_;
+    explicit bad_any_copy(const type_index &type)
+        : std::logic_error("bad_any_copy")
+        , type_(type) {
+    }
+};
+
 template<typename ValueType>
 ValueType * any_cast(any *operand) {
     typedef typename any::template holder<ValueType> holder_t;
@@ -230,116 +367,443 @@ inline ValueType any_cast(const any &operand) {
 
 
 
+// Pass the argument as rvalue if the source can be moved from (MOVABLE),
+// and the parameter is taken by value or by rvalue reference.
+template<typename PARAM, typename MOVABLE>
+struct any_arg_forward {
+    // The parameter can not be initialized from lvalue
+    typedef std::integral_constant<bool, std::is_rvalue_reference<PARAM>::value
+        || (!std::is_reference<PARAM>::value
+            && !std::is_copy_constructible<typename std::remove_cvref<PARAM>::type>::value)> move_only_type;
+
+    template<typename T>
+    static inline T &get(T &value, std::false_type) {
+        return value;
+    }
+    template<typename T>
+    static inline T &&get(T &value, std::true_type) {
+        throw bad_any_cast(type_id<T>(), type_id<PARAM>());
+        return static_cast<T &&>(value);
+    }
+    template<typename T>
+    static inline auto get(T &value) -> decltype(get(value, move_only_type())) {
+        return get(value, move_only_type());
+    }
+};
+
+template<typename PARAM>
+struct any_arg_forward<PARAM, std::true_type> {
+    typedef typename std::conditional<std::is_lvalue_reference<PARAM>::value,
+        std::false_type, std::true_type>::type move_type;
+
+    template<typename T>
+    static inline T &get(T &value, std::false_type) {
+        return value;
+    }
+    template<typename T>
+    static inline T &&get(T &value, std::true_type) {
+        return static_cast<T &&>(value);
+    }
+    template<typename T>
+    static inline auto get(T &value) -> decltype(get(value, move_type())) {
+        return get(value, move_type());
+    }
+};
+
+template<typename T>
+inline void any_check_type(const any &arg) {
+    if (arg.type() != type_id<T>())
+        throw bad_any_cast(arg.type(), type_id<T>());
+}
+
+#if PROMISE_EXCEPTION_CACHE
+// Dynamic type and address of the std::exception thrown in an exception_ptr.
+// The last one looked up is kept per thread, so a chain of fail handlers
+// rethrows the rejection once, not once per handler. It is dropped by
+// any_exception_scope when the chain is done, not to keep the exception.
+struct any_exception_info {
+    std::exception_ptr ptr_;
+    const std::type_info *type_;    // null if not derived from std::exception
+    const void *object_;
+};
+
+inline any_exception_info &any_exception_last() {
+    static thread_local any_exception_info last = { nullptr, nullptr, nullptr };
+    return last;
+}
+
+inline const any_exception_info &any_exception_lookup(const std::exception_ptr &ptr) {
+    any_exception_info &last = any_exception_last();
+    if (last.ptr_ != ptr) {
+        last.ptr_ = nullptr;
+        last.type_ = nullptr;
+        last.object_ = nullptr;
+        try {
+            std::rethrow_exception(ptr);
+        }
+        catch (const std::exception &ex) {
+            last.type_ = &typeid(ex);
+            last.object_ = dynamic_cast<const void *>(&ex);
+        }
+        catch (...) {
+        }
+        last.ptr_ = ptr;
+    }
+    return last;
+}
+
+// Per handler type T, whether catch (const T &) takes a thrown type, and
+// where T is in the thrown object. Both are fixed for a thrown type.
+template<typename T>
+struct any_exception_matcher {
+    struct entry {
+        const std::type_info *from_;
+        ptrdiff_t offset_;
+        bool matched_;
+    };
+    static const size_t entry_count = 4;
+
+    static T *cast(const any_exception_info &info) {
+        static thread_local entry entries[entry_count] = {};
+        entry &e = entries[((uintptr_t)info.type_ / sizeof(void *)) % entry_count];
+        if (e.from_ == nullptr || !(*e.from_ == *info.type_)) {
+            e.from_ = nullptr;
+            e.offset_ = 0;
+            e.matched_ = false;
+            try {
+                std::rethrow_exception(info.ptr_);
+            }
+            catch (const T &ex) {
+                e.offset_ = (const char *)&ex - (const char *)info.object_;
+                e.matched_ = true;
+            }
+            catch (...) {
+            }
+            e.from_ = info.type_;
+        }
+        return e.matched_
+            ? (T *)((const char *)info.object_ + e.offset_)
+            : nullptr;
+    }
+};
+
+// Drops the exception looked up last on exit, if used_ is set
+struct any_exception_scope {
+    any_exception_scope()
+        : used_(false) {
+    }
+    ~any_exception_scope() {
+        if (!used_) return;
+        any_exception_info &last = any_exception_last();
+        last.ptr_ = nullptr;
+        last.type_ = nullptr;
+        last.object_ = nullptr;
+    }
+    bool used_;
+};
+
+// If the exception can be matched without rethrowing it
+inline bool any_exception_known(const std::exception_ptr &ptr) {
+    return any_exception_lookup(ptr).type_ != nullptr;
+}
+
+// The exception as T if catch (const T &) takes it, or nullptr.
+// Called only if any_exception_known(ptr).
+template<typename T>
+inline T *any_exception_cast(const std::exception_ptr &ptr) {
+    return any_exception_matcher<T>::cast(any_exception_lookup(ptr));
+}
+#else
+struct any_exception_scope {
+    bool used_ = false;
+};
+
+inline bool any_exception_known(const std::exception_ptr &) {
+    return false;
+}
+
+template<typename T>
+inline T *any_exception_cast(const std::exception_ptr &) {
+    return nullptr;
+}
+#endif
+
+// Non-owning view of the arguments in an any. A std::vector<any> packed by
+// resolve(ARGS...) is viewed element by element, any other value is viewed
+// as the only argument. Nothing is copied.
+class any_arguments {
+public:
+    explicit any_arguments(const any &arg)
+        : source_(&const_cast<any &>(arg))
+        , data_(source_)
+        , size_(1) {
+        if (arg.type() == type_id<std::vector<any>>()) {
+            std::vector<any> &arguments = any_cast<std::vector<any> &>(*source_);
+            data_ = arguments.data();
+            size_ = arguments.size();
+        }
+    }
+
+    size_t size() const {
+        return size_;
+    }
+    any &operator[](size_t index) const {
+        return data_[index];
+    }
+    // The any being viewed, as it is
+    any &source() const {
+        return *source_;
+    }
+
+private:
+    any *source_;
+    any *data_;
+    size_t size_;
+};
+
 template<typename RET, typename NOCVR_ARGS, typename FUNC>
 struct any_call_t;
 
 template<typename RET, typename ...NOCVR_ARGS, typename FUNC>
 struct any_call_t<RET, std::tuple<NOCVR_ARGS...>, FUNC> {
 
-    static inline RET call(const typename FUNC::fun_type &func, const any &arg) {
-        return call(func, arg, std::make_index_sequence<sizeof...(NOCVR_ARGS)>());
+    template<typename F, typename MOVABLE>
+    static inline RET call(F &func, const any_arguments &args, MOVABLE) {
+        return call(func, args, MOVABLE(), std::make_index_sequence<sizeof...(NOCVR_ARGS)>());
+    }
+
+    static inline bool accepts(const any_arguments &args) {
+        return accepts(args, std::make_index_sequence<sizeof...(NOCVR_ARGS)>());
     }
 
     template<size_t ...I>
-    static inline RET call(const typename FUNC::fun_type &func, const any &arg, const std::index_sequence<I...> &) {
+    static inline bool accepts(const any_arguments &args, const std::index_sequence<I...> &) {
         using nocvr_argument_type = std::tuple<NOCVR_ARGS...>;
-        using any_arguemnt_type = std::vector<any>;
+        if (args.size() < sizeof...(NOCVR_ARGS))
+            return false;
+        bool matched[] = { true, (args[I].type() == type_id<typename std::tuple_element<I, nocvr_argument_type>::type>())... };
+        for (bool one : matched) {
+            if (!one) return false;
+        }
+        return true;
+    }
+
+    template<typename F, typename MOVABLE, size_t ...I>
+    static inline RET call(F &func, const any_arguments &args, MOVABLE, const std::index_sequence<I...> &) {
+        using nocvr_argument_type = std::tuple<NOCVR_ARGS...>;
+        using argument_type = typename FUNC::argument_type;
 
-        const any_arguemnt_type &args = (arg.type() != type_id<any_arguemnt_type>()
-            ? any_arguemnt_type{ arg }
-            : any_cast<any_arguemnt_type &>(arg));
         if(args.size() < sizeof...(NOCVR_ARGS))
-            throw bad_any_cast(arg.type(), type_id<nocvr_argument_type>());
+            throw bad_any_cast(args.source().type(), type_id<nocvr_argument_type>());
+
+        // Check all before any of them is moved
+        int unpack[] = { 0, (any_check_type<typename std::tuple_element<I, nocvr_argument_type>::type>(args[I]), 0)... };
+        (void)unpack;
 
-        return func(any_cast<typename std::tuple_element<I, nocvr_argument_type>::type &>(args[I])...);
+        return func(any_arg_forward<typename std::tuple_element<I, argument_type>::type, MOVABLE>::get(
+            any_cast<typename std::tuple_element<I, nocvr_argument_type>::type &>(args[I]))...);
     }
 };
 
 template<typename RET, typename NOCVR_ARG, typename FUNC>
 struct any_call_t<RET, std::tuple<NOCVR_ARG>, FUNC> {
 
-    static inline RET call(const typename FUNC::fun_type &func, const any &arg) {
-        using nocvr_argument_type = std::tuple<NOCVR_ARG>;
-        using any_arguemnt_type = std::vector<any>;
+    static inline bool accepts(const any_arguments &args) {
+        if (args.size() == 1 && args[0].type() == type_id<std::exception_ptr>()) {
+            const std::exception_ptr &ptr = any_cast<std::exception_ptr &>(args[0]);
+            // Matched by catch clause in call()
+            if (!any_exception_known(ptr))
+                return true;
+            if (any_exception_cast<NOCVR_ARG>(ptr) != nullptr)
+                return true;
+        }
+        if (type_id<NOCVR_ARG>() == type_id<std::vector<any>>())
+            return args.source().type() == type_id<std::vector<any>>();
+        return args.size() >= 1 && args[0].type() == type_id<NOCVR_ARG>();
+    }
 
-        if (arg.type() == type_id<std::exception_ptr>()) {
-            try {
-                std::rethrow_exception(any_cast<std::exception_ptr>(arg));
+    template<typename F, typename MOVABLE>
+    static inline RET call(F &func, const any_arguments &args, MOVABLE) {
+        using nocvr_argument_type = std::tuple<NOCVR_ARG>;
+        using param_type = typename std::tuple_element<0, typename FUNC::argument_type>::type;
+        using forward_type = any_arg_forward<param_type, MOVABLE>;
+
+        if (args.size() == 1 && args[0].type() == type_id<std::exception_ptr>()) {
+            const std::exception_ptr &ptr = any_cast<std::exception_ptr &>(args[0]);
+            if (any_exception_known(ptr)) {
+                NOCVR_ARG *ex_arg = any_exception_cast<NOCVR_ARG>(ptr);
+                if (ex_arg != nullptr)
+                    return func(any_arg_forward<param_type, std::false_type>::get(*ex_arg));
             }
-            catch (const NOCVR_ARG &ex_arg) {
-                return func(const_cast<NOCVR_ARG &>(ex_arg));
+            else {
+                try {
+                    std::rethrow_exception(ptr);
+                }
+                catch (const NOCVR_ARG &ex_arg) {
+                    return func(any_arg_forward<param_type, std::false_type>::get(const_cast<NOCVR_ARG &>(ex_arg)));
+                }
+                catch (...) {
+                }
             }
+            // Not matched, try the exception_ptr itself
         }
 
-        if (type_id<NOCVR_ARG>() == type_id<any_arguemnt_type>()) {
-            return func(any_cast<NOCVR_ARG &>(arg));
+        if (type_id<NOCVR_ARG>() == type_id<std::vector<any>>()) {
+            return func(forward_type::get(any_cast<NOCVR_ARG &>(args.source())));
         }
 
-        const any_arguemnt_type &args = (arg.type() != type_id<any_arguemnt_type>()
-            ? any_arguemnt_type{ arg }
-            : any_cast<any_arguemnt_type &>(arg));
-        if(args.size() < 1)
-            throw bad_any_cast(arg.type(), type_id<nocvr_argument_type>());
-        //printf("[%s] [%s]\n", args.front().type().name(), type_id<NOCVR_ARG>().name());
-        return func(any_cast<NOCVR_ARG &>(args.front()));
+        if (args.size() < 1)
+            throw bad_any_cast(args.source().type(), type_id<nocvr_argument_type>());
+        return func(forward_type::get(any_cast<NOCVR_ARG &>(args[0])));
     }
 };
 
 
 template<typename RET, typename FUNC>
 struct any_call_t<RET, std::tuple<any>, FUNC> {
-    static inline RET call(const typename FUNC::fun_type &func, const any &arg) {
-        using any_arguemnt_type = std::vector<any>;
-        if (arg.type() != type_id<any_arguemnt_type>())
-            return (func(const_cast<any &>(arg)));
+    static inline bool accepts(const any_arguments &) {
+        return true;
+    }
 
-        any_arguemnt_type &args = any_cast<any_arguemnt_type &>(arg);
+    template<typename F, typename MOVABLE>
+    static inline RET call(F &func, const any_arguments &args, MOVABLE) {
+        using forward_type = any_arg_forward<typename std::tuple_element<0, typename FUNC::argument_type>::type, MOVABLE>;
         if (args.size() == 0) {
             any empty;
-            return (func(empty));
+            return (func(forward_type::get(empty)));
         }
         else if(args.size() == 1)
-            return (func(args.front()));
+            return (func(forward_type::get(args[0])));
         else
-            return (func(const_cast<any &>(arg)));
+            return (func(forward_type::get(args.source())));
     }
 };
 
 template<typename RET, typename NOCVR_ARGS, typename FUNC>
 struct any_call_with_ret_t {
-    static inline any call(const typename FUNC::fun_type &func, const any &arg) {
-        return any_call_t<RET, NOCVR_ARGS, FUNC>::call(func, arg);
+    static inline bool accepts(const any_arguments &args) {
+        return any_call_t<RET, NOCVR_ARGS, FUNC>::accepts(args);
+    }
+
+    template<typename F, typename MOVABLE>
+    static inline any call(F &func, const any_arguments &args, MOVABLE) {
+        return any_call_t<RET, NOCVR_ARGS, FUNC>::call(func, args, MOVABLE());
     }
 };
 
 template<typename NOCVR_ARGS, typename FUNC>
 struct any_call_with_ret_t<void, NOCVR_ARGS, FUNC> {
-    static inline any call(const typename FUNC::fun_type &func, const any &arg) {
-        any_call_t<void, NOCVR_ARGS, FUNC>::call(func, arg);
+    static inline bool accepts(const any_arguments &args) {
+        return any_call_t<void, NOCVR_ARGS, FUNC>::accepts(args);
+    }
+
+    template<typename F, typename MOVABLE>
+    static inline any call(F &func, const any_arguments &args, MOVABLE) {
+        any_call_t<void, NOCVR_ARGS, FUNC>::call(func, args, MOVABLE());
         return any();
     }
 };
 
+// A callable that holds no target (null function pointer or empty std::function)
 template<typename FUNC>
-inline any any_call(const FUNC &func, const any &arg) {
-    using func_t = call_traits<FUNC>;
-    using nocvr_argument_type = typename tuple_remove_cvref<typename func_t::argument_type>::type;
-    const auto &stdFunc = func_t::to_std_function(func);
-    if (!stdFunc)
+inline bool any_callable_empty(const FUNC &) {
+    return false;
+}
+
+template<typename RET, typename ...ARG>
+inline bool any_callable_empty(RET(*func)(ARG...)) {
+    return func == nullptr;
+}
+
+template<typename SIGNATURE>
+inline bool any_callable_empty(const std::function<SIGNATURE> &func) {
+    return !func;
+}
+
+// The held value is invoked in place, so no std::function is built per call.
+// Member function pointers have no object to be called on, treat them as
+// not callable, the same as to_std_function does.
+template<typename FUNC,
+         bool CALLABLE = (call_traits<FUNC>::is_callable
+                          && !std::is_member_function_pointer<FUNC>::value)>
+struct any_invoke_t {
+    template<typename MOVABLE>
+    static inline any call(const FUNC &, const any &, MOVABLE) {
         return any();
+    }
 
-    if (arg.type() == type_id<std::exception_ptr>()) {
-        try {
-            std::rethrow_exception(any_cast<std::exception_ptr>(arg));
-        }
-        catch (const any &ex_arg) {
-            return any_call_with_ret_t<typename call_traits<FUNC>::result_type, nocvr_argument_type, func_t>::call(stdFunc, ex_arg);
-        }
-        catch (...) {
+    static inline bool accepts(const FUNC &, const any &) {
+        return true;
+    }
+};
+
+template<typename FUNC>
+struct any_invoke_t<FUNC, true> {
+    template<typename MOVABLE>
+    static inline any call(const FUNC &cfunc, const any &arg, MOVABLE) {
+        using func_t = call_traits<FUNC>;
+        using nocvr_argument_type = typename tuple_remove_cvref<typename func_t::argument_type>::type;
+        using call_t = any_call_with_ret_t<typename func_t::result_type, nocvr_argument_type, func_t>;
+
+        if (any_callable_empty(cfunc))
+            return any();
+        // Allow non-const operator() of the held functor (mutable lambda)
+        FUNC &func = const_cast<FUNC &>(cfunc);
+
+        any_arguments args(arg);
+        // An any may be thrown, std::exception is not an any
+        if (args.size() == 1 && args[0].type() == type_id<std::exception_ptr>()
+            && !any_exception_known(any_cast<std::exception_ptr &>(args[0]))) {
+            try {
+                std::rethrow_exception(any_cast<std::exception_ptr>(args[0]));
+            }
+            catch (const any &ex_arg) {
+                return call_t::call(func, any_arguments(ex_arg), std::false_type());
+            }
+            catch (...) {
+            }
         }
+
+        return call_t::call(func, args, MOVABLE());
     }
 
-    return any_call_with_ret_t<typename call_traits<FUNC>::result_type, nocvr_argument_type, func_t>::call(stdFunc, arg);
+    static inline bool accepts(const FUNC &func, const any &arg) {
+        using func_t = call_traits<FUNC>;
+        using nocvr_argument_type = typename tuple_remove_cvref<typename func_t::argument_type>::type;
+        using call_t = any_call_with_ret_t<typename func_t::result_type, nocvr_argument_type, func_t>;
+
+        if (any_callable_empty(func))
+            return true;
+        any_arguments args(arg);
+        // May be an any thrown, matched in call()
+        if (args.size() == 1 && args[0].type() == type_id<std::exception_ptr>()
+            && !any_exception_known(any_cast<std::exception_ptr &>(args[0])))
+            return true;
+        return call_t::accepts(args);
+    }
+};
+
+// Call func with the arguments packed in arg, they are moved into the
+// parameters if MOVABLE is std::true_type
+template<typename FUNC, typename MOVABLE>
+inline any any_call(const FUNC &func, const any &arg, MOVABLE) {
+    return any_invoke_t<FUNC>::call(func, arg, MOVABLE());
+}
+
+// Check if func can be called with the arguments packed in arg
+template<typename FUNC>
+inline bool any_accepts(const FUNC &func, const any &arg) {
+    return any_invoke_t<FUNC>::accepts(func, arg);
+}
+
+template<typename FUNC>
+inline any any_call(const FUNC &func, const any &arg) {
+    return any_call(func, arg, std::false_type());
+}
+
+template<typename FUNC>
+inline any any_call(const FUNC &func, any &&arg) {
+    return any_call(func, arg, std::true_type());
 }
 
 using pm_any = any;
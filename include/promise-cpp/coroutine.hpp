@@ -0,0 +1,317 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#ifndef INC_PROMISE_COROUTINE_HPP_
+#define INC_PROMISE_COROUTINE_HPP_
+
+/*
+ * C++20 coroutine support, enabled only when the compiler provides
+ * <coroutine>, and a no-op in C++11 mode.
+ *
+ *   co_await promise        suspends until the promise is settled, returns
+ *                           the resolved value as any, or throws the reason.
+ *                           A reason which is not an exception is thrown as
+ *                           any, as with typed::Promise.
+ *   co_await typedPromise   returns T, or rethrows the std::exception_ptr.
+ *
+ * A coroutine declared to return Promise or typed::Promise<T> starts at
+ * once, as newPromise() does, and the returned promise is settled by
+ * co_return or by the exception leaving the coroutine. co_return takes a
+ * value only in a coroutine returning typed::Promise<T>. The whole coroutine
+ * is kept in one frame, so no handler is created for each step.
+ *
+ *   Promise session(std::shared_ptr<Session> session) {
+ *       while (!session->close_) {
+ *           co_await async_read(session->socket_, session->buffer_, session->req_);
+ *           co_await handle_request(session);
+ *       }
+ *   }
+ */
+
+#include "promise.hpp"
+#include "typed_promise.hpp"
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#   if __has_include(<coroutine>)
+#       define PROMISE_COROUTINE 1
+#   endif
+#endif
+
+#ifdef PROMISE_COROUTINE
+#include <coroutine>
+#include <optional>
+
+namespace promise {
+
+/*
+ * The handler may be called on another thread while await_suspend() is
+ * still running, or within then() if the promise is settled already. The
+ * one arriving last continues the coroutine, so a settled promise does not
+ * suspend at all and a loop of them does not grow the stack.
+ */
+struct AwaitStateBase {
+    enum { kIdle, kSuspended, kSettled };
+
+    // handle_ is set before the handler is added
+    bool suspend() {
+        return state_.exchange(kSuspended) != kSettled;
+    }
+
+    void settle() {
+        if (state_.exchange(kSettled) == kSuspended)
+            handle_.resume();
+    }
+
+    std::coroutine_handle<> handle_;
+#if PROMISE_MULTITHREAD
+    std::atomic<int>        state_{ kIdle };
+#else
+    struct PlainState {
+        int exchange(int value) { int old = value_; value_ = value; return old; }
+        int value_;
+    }                       state_{ kIdle };
+#endif
+};
+
+template<typename AWAITER>
+struct AwaitResolved {
+    void operator()(any &value) const {
+        awaiter_->value_ = std::move(value);
+        awaiter_->settle();
+    }
+    AWAITER *awaiter_;
+};
+
+template<typename AWAITER>
+struct AwaitRejected {
+    void operator()(const any &reason) const {
+        awaiter_->error_ = typed::toExceptionPtr(reason);
+        awaiter_->settle();
+    }
+    AWAITER *awaiter_;
+};
+
+// The value is moved out of the promise, the handlers after co_await are
+// called with nothing as they are after a then() returning void.
+struct PromiseAwaiter : AwaitStateBase {
+    explicit PromiseAwaiter(const Promise &promise)
+        : promise_(promise) {
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+        handle_ = handle;
+        promise_.then(AwaitResolved<PromiseAwaiter>{ this },
+                      AwaitRejected<PromiseAwaiter>{ this });
+        return suspend();
+    }
+
+    any await_resume() {
+        if (error_)
+            std::rethrow_exception(error_);
+        return std::move(value_);
+    }
+
+    Promise            promise_;
+    any                value_;
+    std::exception_ptr error_;
+};
+
+inline PromiseAwaiter operator co_await(const Promise &promise) {
+    return PromiseAwaiter(promise);
+}
+
+// Promise returned by a coroutine, co_return takes no value. A promise type
+// can not declare return_value() with return_void(), which keeps flowing off
+// the end defined. To resolve with a value, the coroutine is declared to
+// return typed::Promise<T>, which converts to Promise.
+struct PromiseCoroutine {
+    Promise get_return_object() {
+        return promise_;
+    }
+
+    std::suspend_never initial_suspend() noexcept {
+        return {};
+    }
+
+    std::suspend_never final_suspend() noexcept {
+        return {};
+    }
+
+    void return_void() {
+        promise_.resolve();
+    }
+
+    // The reason thrown by co_await is restored as is
+    void unhandled_exception() {
+        try {
+            throw;
+        }
+        catch (const any &reason) {
+            promise_.reject(reason);
+            return;
+        }
+        catch (...) {
+        }
+        promise_.reject(any(std::current_exception()));
+    }
+
+    Promise promise_ = newPromise();
+};
+
+namespace typed {
+
+template<typename AWAITER, typename S>
+struct AwaitResolved {
+    void operator()(const S &value) const {
+        awaiter_->value_.emplace(value);
+        awaiter_->settle();
+    }
+    AWAITER *awaiter_;
+};
+
+template<typename AWAITER>
+struct AwaitResolved<AWAITER, Void> {
+    void operator()() const {
+        awaiter_->settle();
+    }
+    AWAITER *awaiter_;
+};
+
+template<typename AWAITER>
+struct AwaitRejected {
+    void operator()(const std::exception_ptr &error) const {
+        awaiter_->error_ = error;
+        awaiter_->settle();
+    }
+    AWAITER *awaiter_;
+};
+
+// The value is shared by all handlers, so co_await returns a copy of it
+template<typename T>
+struct PromiseAwaiter : AwaitStateBase {
+    typedef typename Stored<T>::type stored_type;
+
+    explicit PromiseAwaiter(const Promise<T> &promise)
+        : promise_(promise) {
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+        handle_ = handle;
+        promise_.then(AwaitResolved<PromiseAwaiter, stored_type>{ this },
+                      AwaitRejected<PromiseAwaiter>{ this });
+        return suspend();
+    }
+
+    T await_resume() {
+        if (error_)
+            std::rethrow_exception(error_);
+        return resume(static_cast<T *>(nullptr));
+    }
+
+    template<typename U>
+    U resume(U *) {
+        return std::move(*value_);
+    }
+
+    void resume(void *) {
+    }
+
+    Promise<T>                  promise_;
+    std::optional<stored_type>  value_;
+    std::exception_ptr          error_;
+};
+
+template<typename T>
+inline PromiseAwaiter<T> operator co_await(const Promise<T> &promise) {
+    return PromiseAwaiter<T>(promise);
+}
+
+template<typename T>
+struct PromiseCoroutineBase {
+    Promise<T> get_return_object() {
+        return promise_;
+    }
+
+    std::suspend_never initial_suspend() noexcept {
+        return {};
+    }
+
+    std::suspend_never final_suspend() noexcept {
+        return {};
+    }
+
+    void unhandled_exception() {
+        promise_.reject(std::current_exception());
+    }
+
+    Promise<T> promise_ = newPromise<T>();
+};
+
+// Promise<T> returned by a coroutine, co_return takes the value of T
+template<typename T>
+struct PromiseCoroutine : PromiseCoroutineBase<T> {
+    template<typename U>
+    void return_value(U &&value) {
+        this->promise_.resolve(std::forward<U>(value));
+    }
+};
+
+template<>
+struct PromiseCoroutine<void> : PromiseCoroutineBase<void> {
+    void return_void() {
+        this->promise_.resolve();
+    }
+};
+
+} // namespace typed
+} // namespace promise
+
+namespace std {
+
+template<typename ...ARGS>
+struct coroutine_traits<promise::Promise, ARGS...> {
+    typedef promise::PromiseCoroutine promise_type;
+};
+
+template<typename T, typename ...ARGS>
+struct coroutine_traits<promise::typed::Promise<T>, ARGS...> {
+    typedef promise::typed::PromiseCoroutine<T> promise_type;
+};
+
+} // namespace std
+
+#endif // PROMISE_COROUTINE
+
+#endif
@@ -42,17 +42,474 @@
 #   define PROMISE_MULTITHREAD 1
 #endif
 
+// Allocate the internal objects of promise chain from thread cached pools
+#ifndef PROMISE_POOL
+#   define PROMISE_POOL 1
+#endif
+
 
 #include <list>
+#include <iterator>
 #include <vector>
 #include <memory>
 #include <functional>
 #include <mutex>
+#include <thread>
 #include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <stdexcept>
 #include "any.hpp"
 
+#if PROMISE_MULTITHREAD && defined(__has_include)
+#   if __has_include(<sys/single_threaded.h>)
+#       include <sys/single_threaded.h>
+#       define PROMISE_HAS_SINGLE_THREADED 1
+#   endif
+#endif
+#ifndef PROMISE_HAS_SINGLE_THREADED
+#   define PROMISE_HAS_SINGLE_THREADED 0
+#endif
+
+// Interop of CancellationToken with std::stop_token in C++20
+#if PROMISE_MULTITHREAD && defined(__has_include) && __cplusplus >= 202002L
+#   if __has_include(<stop_token>)
+#       include <stop_token>
+#       define PROMISE_STOP_TOKEN 1
+#   endif
+#endif
+#ifndef PROMISE_STOP_TOKEN
+#   define PROMISE_STOP_TOKEN 0
+#endif
+
 namespace promise {
 
+/*
+ * Intrusive reference counting for the internal objects of a promise chain.
+ *
+ * An object is disposed (dispose() is called) when the last IntrusivePtr to it
+ * is released, and the memory is freed when the last IntrusiveWeakPtr is released.
+ * The counters are atomic only in multithread mode.
+ */
+#if PROMISE_MULTITHREAD
+typedef std::atomic<size_t> RefCountWord;
+
+// As std::shared_ptr in libstdc++ does, skip the locked instructions
+// while no thread was ever created by the process.
+inline bool isSingleThreaded() {
+#if PROMISE_HAS_SINGLE_THREADED
+    return __libc_single_threaded;
+#else
+    return false;
+#endif
+}
+
+inline void refIncrease(RefCountWord &count) {
+    if (isSingleThreaded())
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    else
+        count.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Returns true if the counter dropped to zero
+inline bool refDecrease(RefCountWord &count) {
+    if (isSingleThreaded()) {
+        size_t value = count.load(std::memory_order_relaxed) - 1;
+        count.store(value, std::memory_order_relaxed);
+        return (value == 0);
+    }
+    return (count.fetch_sub(1, std::memory_order_acq_rel) == 1);
+}
+
+inline bool refIncreaseIfNotZero(RefCountWord &count) {
+    size_t value = count.load(std::memory_order_relaxed);
+    if (isSingleThreaded()) {
+        if (value == 0) return false;
+        count.store(value + 1, std::memory_order_relaxed);
+        return true;
+    }
+    while (value != 0) {
+        if (count.compare_exchange_weak(value, value + 1, std::memory_order_relaxed))
+            return true;
+    }
+    return false;
+}
+
+// The caller holds the only reference if it reads one
+inline bool refIsUnique(const RefCountWord &count) {
+    return count.load(std::memory_order_acquire) == 1;
+}
+#else
+typedef size_t RefCountWord;
+
+inline void refIncrease(RefCountWord &count) {
+    ++count;
+}
+
+inline bool refDecrease(RefCountWord &count) {
+    return (--count == 0);
+}
+
+inline bool refIncreaseIfNotZero(RefCountWord &count) {
+    if (count == 0) return false;
+    ++count;
+    return true;
+}
+
+inline bool refIsUnique(const RefCountWord &count) {
+    return count == 1;
+}
+#endif
+
+/*
+ * Pool for the fixed size internal objects (Task, PromiseHolder, SharedPromise
+ * and so on). Blocks are grouped by size class and carved from slabs, each
+ * thread keeps a cache of free blocks and exchanges them with a global depot
+ * in batches. The memory of slabs is kept by the pool for reuse.
+ */
+struct PoolStatistics {
+    size_t hits_;      // allocations served by the cache of calling thread
+    size_t misses_;    // allocations which have to refill the cache of calling thread
+    size_t slabs_;     // slabs allocated from system by all threads
+};
+
+#if PROMISE_POOL
+PROMISE_API void *poolAllocate(size_t size);
+PROMISE_API void poolFree(void *ptr, size_t size);
+#endif
+PROMISE_API PoolStatistics getPoolStatistics();
+
+/*
+ * Microtask mode of the calling thread, disabled by default.
+ * When enabled, a continuation which becomes ready inside a running
+ * continuation is put to a thread local queue instead of being called
+ * recursively, and the outermost resolve/then runs the queue in a loop,
+ * like microtasks in JavaScript. The stack depth is bounded then, even for
+ * a very long chain resolved synchronously.
+ */
+PROMISE_API void setMicrotaskMode(bool enabled);
+PROMISE_API bool getMicrotaskMode();
+
+/*
+ * Thread affine mode of the calling thread, disabled by default.
+ * When enabled, a promise created in this thread is locked without any
+ * atomic read-modify-write while it is touched only by this thread. The
+ * first lock from another thread revokes it, and the promise is locked
+ * as usual since then. No effect if PROMISE_MULTITHREAD is 0.
+ */
+PROMISE_API void setThreadAffineMode(bool enabled);
+PROMISE_API bool getThreadAffineMode();
+
+template<typename T>
+struct RefCounted {
+    RefCounted()
+        : strongCount_(0)
+        , weakCount_(1) {   // all strong references hold one weak reference
+    }
+    RefCounted(const RefCounted &) = delete;
+    RefCounted &operator=(const RefCounted &) = delete;
+
+    inline void retain() {
+        refIncrease(strongCount_);
+    }
+
+    inline void release() {
+        if (refDecrease(strongCount_)) {
+            static_cast<T *>(this)->dispose();
+            // Nobody else can take a new reference if there is no weak one
+            if (refIsUnique(weakCount_))
+                delete static_cast<T *>(this);
+            else
+                releaseWeak();
+        }
+    }
+
+    inline bool tryRetain() {
+        return refIncreaseIfNotZero(strongCount_);
+    }
+
+    inline void retainWeak() {
+        refIncrease(weakCount_);
+    }
+
+    inline void releaseWeak() {
+        if (refDecrease(weakCount_))
+            delete static_cast<T *>(this);
+    }
+
+    // Release resources when no strong reference, may be hidden by T
+    inline void dispose() {
+    }
+
+#if PROMISE_POOL
+    static void *operator new(size_t size) {
+        return poolAllocate(size);
+    }
+    static void operator delete(void *ptr, size_t size) {
+        poolFree(ptr, size);
+    }
+#endif
+
+private:
+    RefCountWord strongCount_;
+    RefCountWord weakCount_;
+};
+
+template<typename T>
+class IntrusiveWeakPtr;
+
+template<typename T>
+class IntrusivePtr {
+public:
+    IntrusivePtr()
+        : ptr_(nullptr) {
+    }
+    IntrusivePtr(std::nullptr_t)
+        : ptr_(nullptr) {
+    }
+    explicit IntrusivePtr(T *ptr)
+        : ptr_(ptr) {
+        if (ptr_) ptr_->retain();
+    }
+    IntrusivePtr(const IntrusivePtr &other)
+        : ptr_(other.ptr_) {
+        if (ptr_) ptr_->retain();
+    }
+    IntrusivePtr(IntrusivePtr &&other)
+        : ptr_(other.ptr_) {
+        other.ptr_ = nullptr;
+    }
+    ~IntrusivePtr() {
+        if (ptr_) ptr_->release();
+    }
+
+    IntrusivePtr &operator=(const IntrusivePtr &other) {
+        IntrusivePtr(other).swap(*this);
+        return *this;
+    }
+    IntrusivePtr &operator=(IntrusivePtr &&other) {
+        IntrusivePtr(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    inline void swap(IntrusivePtr &other) {
+        std::swap(ptr_, other.ptr_);
+    }
+    inline void reset() {
+        IntrusivePtr().swap(*this);
+    }
+
+    inline T *get() const { return ptr_; }
+    inline T *operator->() const { return ptr_; }
+    inline T &operator*() const { return *ptr_; }
+    inline explicit operator bool() const { return ptr_ != nullptr; }
+
+    inline bool operator==(const IntrusivePtr &other) const { return ptr_ == other.ptr_; }
+    inline bool operator!=(const IntrusivePtr &other) const { return ptr_ != other.ptr_; }
+    inline bool operator==(std::nullptr_t) const { return ptr_ == nullptr; }
+    inline bool operator!=(std::nullptr_t) const { return ptr_ != nullptr; }
+
+private:
+    friend class IntrusiveWeakPtr<T>;
+    struct AdoptTag {};
+    // Take the reference which is already retained
+    IntrusivePtr(T *ptr, AdoptTag)
+        : ptr_(ptr) {
+    }
+
+    T *ptr_;
+};
+
+template<typename T>
+class IntrusiveWeakPtr {
+public:
+    IntrusiveWeakPtr()
+        : ptr_(nullptr) {
+    }
+    IntrusiveWeakPtr(const IntrusivePtr<T> &other)
+        : ptr_(other.get()) {
+        if (ptr_) ptr_->retainWeak();
+    }
+    IntrusiveWeakPtr(const IntrusiveWeakPtr &other)
+        : ptr_(other.ptr_) {
+        if (ptr_) ptr_->retainWeak();
+    }
+    IntrusiveWeakPtr(IntrusiveWeakPtr &&other)
+        : ptr_(other.ptr_) {
+        other.ptr_ = nullptr;
+    }
+    ~IntrusiveWeakPtr() {
+        if (ptr_) ptr_->releaseWeak();
+    }
+
+    IntrusiveWeakPtr &operator=(const IntrusiveWeakPtr &other) {
+        IntrusiveWeakPtr(other).swap(*this);
+        return *this;
+    }
+    IntrusiveWeakPtr &operator=(IntrusiveWeakPtr &&other) {
+        IntrusiveWeakPtr(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    inline void swap(IntrusiveWeakPtr &other) {
+        std::swap(ptr_, other.ptr_);
+    }
+    inline void reset() {
+        IntrusiveWeakPtr().swap(*this);
+    }
+
+    // Returns null if the object was disposed
+    inline IntrusivePtr<T> lock() const {
+        if (ptr_ && ptr_->tryRetain())
+            return IntrusivePtr<T>(ptr_, typename IntrusivePtr<T>::AdoptTag());
+        return IntrusivePtr<T>();
+    }
+
+private:
+    T *ptr_;
+};
+
+template<typename T, typename ...ARGS>
+inline IntrusivePtr<T> makeIntrusive(ARGS &&...args) {
+    return IntrusivePtr<T>(new T(std::forward<ARGS>(args)...));
+}
+
+/*
+ * Vector which stores the first N items inline and spills to heap after that.
+ * Almost all promise holders have only one or two tasks and one owner.
+ * pop_front() is O(1), it moves the head index only.
+ */
+template<typename T, size_t N>
+class SmallVector {
+public:
+    typedef T *iterator;
+    typedef const T *const_iterator;
+
+    SmallVector()
+        : data_(inlineData())
+        , head_(0)
+        , tail_(0)
+        , capacity_((uint32_t)N) {
+    }
+    SmallVector(const SmallVector &) = delete;
+    SmallVector &operator=(const SmallVector &) = delete;
+    ~SmallVector() {
+        clear();
+        freeData();
+    }
+
+    inline size_t size() const { return tail_ - head_; }
+    inline bool empty() const { return tail_ == head_; }
+    inline T &front() { return data_[head_]; }
+    inline const T &front() const { return data_[head_]; }
+    inline iterator begin() { return data_ + head_; }
+    inline iterator end() { return data_ + tail_; }
+    inline const_iterator begin() const { return data_ + head_; }
+    inline const_iterator end() const { return data_ + tail_; }
+
+    void push_back(const T &value) {
+        if (tail_ == capacity_) reserve(size() + 1);
+        new (data_ + tail_) T(value);
+        ++tail_;
+    }
+    void push_back(T &&value) {
+        if (tail_ == capacity_) reserve(size() + 1);
+        new (data_ + tail_) T(std::move(value));
+        ++tail_;
+    }
+
+    void pop_front() {
+        data_[head_].~T();
+        if (++head_ == tail_)
+            head_ = tail_ = 0;
+    }
+
+    void clear() {
+        for (uint32_t i = head_; i < tail_; ++i)
+            data_[i].~T();
+        head_ = tail_ = 0;
+    }
+
+    // Remove the items matching pred, the order of others is kept
+    template<typename PRED>
+    void remove_if(PRED pred) {
+        uint32_t tail = head_;
+        for (uint32_t i = head_; i < tail_; ++i) {
+            if (pred(data_[i])) continue;
+            if (i != tail) data_[tail] = std::move(data_[i]);
+            ++tail;
+        }
+        for (uint32_t i = tail; i < tail_; ++i)
+            data_[i].~T();
+        tail_ = tail;
+        if (head_ == tail_)
+            head_ = tail_ = 0;
+    }
+
+    // Move all items of other to the end of this one, other will be empty
+    void splice(SmallVector &other) {
+        if (other.empty()) return;
+        if (empty() && other.data_ != other.inlineData()) {
+            // Take the heap buffer of other
+            freeData();
+            data_ = other.data_;
+            head_ = other.head_;
+            tail_ = other.tail_;
+            capacity_ = other.capacity_;
+            other.data_ = other.inlineData();
+            other.head_ = other.tail_ = 0;
+            other.capacity_ = (uint32_t)N;
+            return;
+        }
+        if (capacity_ - tail_ < other.size())
+            reserve(size() + other.size());
+        for (T &value : other) {
+            new (data_ + tail_) T(std::move(value));
+            ++tail_;
+        }
+        other.clear();
+    }
+
+private:
+    // Make room for count items from index 0
+    void reserve(size_t count) {
+        T *data = data_;
+        if (count > capacity_) {
+            size_t capacity = (size_t)capacity_ * 2;
+            if (capacity < count) capacity = count;
+            data = static_cast<T *>(::operator new(capacity * sizeof(T)));
+            capacity_ = (uint32_t)capacity;
+        }
+        uint32_t size = tail_ - head_;
+        for (uint32_t i = 0; i < size; ++i) {
+            new (data + i) T(std::move(data_[head_ + i]));
+            data_[head_ + i].~T();
+        }
+        if (data != data_) {
+            freeData();
+            data_ = data;
+        }
+        head_ = 0;
+        tail_ = size;
+    }
+
+    inline T *inlineData() {
+        return reinterpret_cast<T *>(inline_);
+    }
+
+    inline void freeData() {
+        if (data_ != inlineData())
+            ::operator delete(data_);
+    }
+
+    T *data_;
+    uint32_t head_;
+    uint32_t tail_;
+    uint32_t capacity_;
+    alignas(T) unsigned char inline_[N * sizeof(T)];
+};
+
 enum class TaskState {
     kPending,
     kResolved,
@@ -62,43 +519,144 @@ enum class TaskState {
 struct PromiseHolder;
 struct SharedPromise;
 class Promise;
+class Defer;
+class DeferLoop;
+
+/*
+ * The state word of task and promise holder. It is atomic in multithread mode,
+ * so that a settled task or a pending promise can be checked without locking.
+ * The settlement of a task by its defers is claimed by a CAS, so only the
+ * first one locks the promise holder.
+ */
+#if PROMISE_MULTITHREAD
+typedef std::atomic<TaskState> TaskStateWord;
+#else
+typedef TaskState TaskStateWord;
+#endif
 
-struct Task {
-    TaskState state_;
-    std::weak_ptr<PromiseHolder> promiseHolder_;
-    any                          onResolved_;
-    any                          onRejected_;
+#if PROMISE_MULTITHREAD
+// Lock of one byte, for the few instructions copying or swapping a pointer
+struct SpinLock {
+    SpinLock()
+        : locked_(false) {
+    }
+    inline void lock() {
+        while (locked_.exchange(true, std::memory_order_acquire)) {
+            while (locked_.load(std::memory_order_relaxed))
+                std::this_thread::yield();
+        }
+    }
+    inline void unlock() {
+        locked_.store(false, std::memory_order_release);
+    }
+    std::atomic<bool> locked_;
 };
+#endif
 
+struct Task : public RefCounted<Task> {
+    Task(TaskState state,
+         const IntrusivePtr<PromiseHolder> &promiseHolder,
+         any &&onResolved,
+         any &&onRejected)
+        : state_(state)
 #if PROMISE_MULTITHREAD
+        , claimed_(false)
+        , next_(nullptr)
+#endif
+        , promiseHolder_(promiseHolder)
+        , onResolved_(std::move(onResolved))
+        , onRejected_(std::move(onRejected)) {
+    }
+
+    // promiseHolder_ is changed by join() with the holder locked, and read
+    // before the holder is known, so it is copied and changed by these
+    PROMISE_API IntrusivePtr<PromiseHolder> getPromiseHolder() const;
+    PROMISE_API void setPromiseHolder(const IntrusivePtr<PromiseHolder> &promiseHolder);
+
+    TaskStateWord                   state_;
+#if PROMISE_MULTITHREAD
+    std::atomic<bool>               claimed_;   // set by the first defer settling it
+    mutable SpinLock                spinLock_;  // guards promiseHolder_
+    Task                           *next_;      // in PromiseHolder::inbox_
+#endif
+    IntrusiveWeakPtr<PromiseHolder> promiseHolder_;
+    any                             onResolved_;
+    any                             onRejected_;
+};
+
+#if PROMISE_MULTITHREAD
+/*
+ * Recursive lock of one word, embedded in each PromiseHolder.
+ * word_ holds the index of the owner thread and a few flags, depth_ is the
+ * number of levels locked by the owner. A thread waiting for the lock is
+ * parked in a global table of wait queues, hashed by the lock address and
+ * sized to the cores, so per promise nothing else is allocated.
+ */
 struct Mutex {
 public:
     PROMISE_API Mutex();
+    // Biased to the calling thread, which locks it without any atomic
+    // read-modify-write until another thread revokes it
+    PROMISE_API explicit Mutex(bool biased);
+    Mutex(const Mutex &) = delete;
+    Mutex &operator=(const Mutex &) = delete;
+
     PROMISE_API void lock();
     PROMISE_API void unlock();
+    // Lock or unlock lock_count levels at once, in O(1)
     PROMISE_API void lock(size_t lock_count);
     PROMISE_API void unlock(size_t lock_count);
-    inline size_t lock_count() const { return lock_count_; }
-    std::condition_variable_any cond_;
+    inline size_t lock_count() const {
+        return depth_.load(std::memory_order_relaxed) & ~kBiasedSection;
+    }
+
 private:
-    std::recursive_mutex mutex_;
-    size_t lock_count_;
+    static const uint32_t kParked   = 1;    // some thread is parked on it
+    static const uint32_t kBiased   = 2;    // owned by the bias owner in word_, unless revoked
+    static const uint32_t kRevoke   = 4;    // another thread is waiting to revoke the bias
+    static const uint32_t kIdShift  = 3;
+    static const uint32_t kBiasedSection = 0x80000000u; // depth_ of the bias owner
+
+    PROMISE_API void lockSlow(uint32_t self);
+    PROMISE_API void park(uint32_t word);
+    PROMISE_API void unpark();
+
+    std::atomic<uint32_t> word_;
+    std::atomic<uint32_t> depth_;   // written by the thread holding the lock only
 };
 #endif
 
+struct CancelState;
+
 /* 
  * Task state in TaskList always be kPending
  */
-struct PromiseHolder {
+struct PromiseHolder : public RefCounted<PromiseHolder> {
     PROMISE_API PromiseHolder();
-    PROMISE_API ~PromiseHolder();
-    std::list<std::weak_ptr<SharedPromise>> owners_;
-    std::list<std::shared_ptr<Task>>        pendingTasks_;
-    TaskState                               state_;
-    any                                     value_;
+    typedef SmallVector<IntrusivePtr<Task>, 2> TaskList;
+
+    PROMISE_API void dispose();
+    TaskList            pendingTasks_;
+    TaskStateWord       state_;
+    // Set while a handler runs unlocked or the task in front hops to its
+    // executor, state_ is pending then but the promise is settled already
+    bool                busy_;
+    uint32_t            rank_;          // union by rank in join()
+    any                 value_;
 #if PROMISE_MULTITHREAD
-    std::shared_ptr<Mutex>                  mutex_;
+    Mutex               mutex_;
+    mutable SpinLock    spinLock_;      // guards forward_
+    // Head of the lock free stack of the tasks added by then() without
+    // locking, which are taken to pendingTasks_ with the holder locked
+    std::atomic<Task *> inbox_;
 #endif
+    IntrusivePtr<CancelState> cancel_;  // created when the promise may be cancelled
+
+    // Set by join() if this holder is joined to another one, the promises
+    // find the root holder by it in SharedPromise::obtainLock()
+    IntrusivePtr<PromiseHolder> forward_;
+    PROMISE_API IntrusivePtr<PromiseHolder> getForward() const;
+    PROMISE_API void setForward(const IntrusivePtr<PromiseHolder> &forward);
 
     PROMISE_API void dump() const;
     PROMISE_API static any *getUncaughtExceptionHandler();
@@ -107,17 +665,140 @@ struct PromiseHolder {
     PROMISE_API static void handleUncaughtException(const any &onUncaughtException);
 };
 
+// Reason of the promise rejected by cancellation
+class cancelled_error : public std::runtime_error {
+public:
+    cancelled_error()
+        : std::runtime_error("promise cancelled") {
+    }
+};
+
+// Reason of anyOf() and some() when too many promises are rejected,
+// reasons_ holds the reasons in the order they were rejected.
+class aggregate_error : public std::runtime_error {
+public:
+    explicit aggregate_error(std::vector<any> &&reasons)
+        : std::runtime_error("promises rejected")
+        , reasons_(std::move(reasons)) {
+    }
+
+    std::vector<any> reasons_;
+};
+
+/*
+ * Shared state of a cancellation source and its tokens, and of a promise
+ * which may be cancelled. Callbacks are called once when it is cancelled.
+ * A state linked to a parent is cancelled with the parent, and a state of
+ * promise rejects the promise holder by cancelled_error.
+ */
+struct CancelState : public RefCounted<CancelState> {
+    typedef SmallVector<std::pair<size_t, std::function<void()>>, 1>  Callbacks;
+    typedef SmallVector<std::pair<IntrusivePtr<CancelState>, size_t>, 1> Links;
+
+    PROMISE_API CancelState();
+    PROMISE_API void dispose();
+
+    // Returns the id for remove(), or 0 if it was cancelled and func is called
+    PROMISE_API size_t add(std::function<void()> &&func);
+    PROMISE_API void remove(size_t id);
+    PROMISE_API void link(const IntrusivePtr<CancelState> &parent);
+    PROMISE_API void cancel();
+    PROMISE_API void rejectHolder(const IntrusivePtr<PromiseHolder> &promiseHolder);
+    // Drop the callbacks as the promise is settled, links are kept
+    PROMISE_API void settle(Callbacks &dropped);
+
+#if PROMISE_MULTITHREAD
+    std::mutex                      mutex_;
+#endif
+    std::atomic<bool>               cancelled_;
+    size_t                          nextId_;
+    Callbacks                       callbacks_;
+    Links                           links_;
+    IntrusiveWeakPtr<PromiseHolder> promiseHolder_;
+#if PROMISE_STOP_TOKEN
+    std::stop_source                stopSource_;
+    std::shared_ptr<void>           stopCallback_;
+#endif
+};
+
+class CancellationToken {
+public:
+    // A token which is never cancelled
+    CancellationToken() {
+    }
+#if PROMISE_STOP_TOKEN
+    // Cancelled when stop is requested on stopToken
+    PROMISE_API explicit CancellationToken(const std::stop_token &stopToken);
+    PROMISE_API std::stop_token getStopToken() const;
+#endif
+
+    PROMISE_API bool isCancelled() const;
+    // Call func once when cancelled, or at once if it was cancelled already.
+    // Returns the id for removeOnCancel(), or 0 if func will not be kept.
+    PROMISE_API size_t onCancel(std::function<void()> &&func) const;
+    PROMISE_API void removeOnCancel(size_t id) const;
+
+private:
+    friend class CancellationSource;
+    friend class Defer;
+    friend PROMISE_API Promise newPromise(const std::function<void(Defer &defer)> &run, const CancellationToken &token);
+    explicit CancellationToken(const IntrusivePtr<CancelState> &state)
+        : state_(state) {
+    }
+    IntrusivePtr<CancelState> state_;
+};
+
+class CancellationSource {
+public:
+    PROMISE_API CancellationSource();
+    // Cancelled also when the parent is cancelled
+    PROMISE_API explicit CancellationSource(const CancellationToken &parent);
+
+    PROMISE_API CancellationToken getToken() const;
+    PROMISE_API void cancel() const;
+    PROMISE_API bool isCancelled() const;
+
+private:
+    IntrusivePtr<CancelState> state_;
+};
+
 // Check if ...ARGS only has one any type
 template<typename ...ARGS>
 struct is_one_any : public std::is_same<typename tuple_remove_cvref<std::tuple<ARGS...>>::type, std::tuple<any>> {
 };
 
-struct SharedPromise {
-    std::shared_ptr<PromiseHolder> promiseHolder_;
-    PROMISE_API void dump() const;
+// Pack the arguments of resolve/reject, rvalues are moved into the pack
+template<typename ...ARGS>
+inline any makeArguments(ARGS &&...args) {
+    std::vector<any> arguments;
+    arguments.reserve(sizeof...(ARGS));
+    int unpack[] = { 0, (arguments.emplace_back(std::forward<ARGS>(args)), 0)... };
+    (void)unpack;
+    return any(std::move(arguments));
+}
+
+struct SharedPromise : public RefCounted<SharedPromise> {
+    SharedPromise() {
+    }
+    explicit SharedPromise(const IntrusivePtr<PromiseHolder> &promiseHolder)
+        : promiseHolder_(promiseHolder) {
+    }
+    inline void dispose() {
+        promiseHolder_.reset();
+    }
+
+    // Same as Task, promiseHolder_ is moved to the root by obtainLock()
+    PROMISE_API IntrusivePtr<PromiseHolder> getPromiseHolder() const;
+    PROMISE_API void setPromiseHolder(const IntrusivePtr<PromiseHolder> &promiseHolder);
+
 #if PROMISE_MULTITHREAD
-    PROMISE_API std::shared_ptr<Mutex> obtainLock() const;
+    mutable SpinLock            spinLock_;  // guards promiseHolder_
 #endif
+    IntrusivePtr<PromiseHolder> promiseHolder_;
+    PROMISE_API void dump() const;
+    // Find the root holder by the forward_ links and keep it in
+    // promiseHolder_, then lock it if PROMISE_MULTITHREAD and return it.
+    PROMISE_API IntrusivePtr<PromiseHolder> obtainLock();
 };
 
 class Defer {
@@ -125,26 +806,70 @@ public:
     template<typename ...ARGS,
         typename std::enable_if<!is_one_any<ARGS...>::value>::type *dummy = nullptr>
     inline void resolve(ARGS &&...args) const {
-        resolve(any{ std::vector<any>{std::forward<ARGS>(args)...} });
+        resolve(makeArguments(std::forward<ARGS>(args)...));
     }
 
     template<typename ...ARGS,
         typename std::enable_if<!is_one_any<ARGS...>::value>::type *dummy = nullptr>
     inline void reject(ARGS &&...args) const {
-        reject(any{ std::vector<any>{std::forward<ARGS>(args)...} });
+        reject(makeArguments(std::forward<ARGS>(args)...));
     }
 
     PROMISE_API void resolve(const any &arg) const;
     PROMISE_API void reject(const any &arg) const;
+    PROMISE_API void resolve(any &&arg) const;
+    PROMISE_API void reject(any &&arg) const;
 
     PROMISE_API Promise getPromise() const;
 
+    // Call func to stop the work when the promise is cancelled before settled
+    PROMISE_API void onCancel(std::function<void()> &&func) const;
+    // Token which is cancelled with the promise, for the nested work
+    PROMISE_API CancellationToken getToken() const;
+
 private:
     friend class Promise;
+    friend class SettleBatch;
+    friend struct BatchSettler;
+    friend struct CancelState;
+    friend struct LoopState;
     friend PROMISE_API Promise newPromise(const std::function<void(Defer &defer)> &run);
-    PROMISE_API Defer(const std::shared_ptr<Task> &task);
-    std::shared_ptr<Task>          task_;
-    std::shared_ptr<SharedPromise> sharedPromise_;
+    friend PROMISE_API Promise newPromise(const std::function<void(Defer &defer)> &run, const CancellationToken &token);
+    friend PROMISE_API Promise doWhile(const std::function<void(DeferLoop &loop)> &run);
+    PROMISE_API Defer(const IntrusivePtr<Task> &task);
+    IntrusivePtr<Task>          task_;
+    IntrusivePtr<SharedPromise> sharedPromise_;
+};
+
+/*
+ * State of doWhile() shared by all the iterations, so an iteration creates
+ * no promise. word_ holds the iteration number and the phase of it in the
+ * low 2 bits. A DeferLoop of a finished iteration is ignored, as a settled
+ * Defer is, and doContinue() called inside the iteration is looped instead
+ * of recursed.
+ */
+struct LoopState : public RefCounted<LoopState> {
+    enum Phase {
+        kRunning,   // in run_
+        kContinued, // doContinue() called in run_
+        kWaiting,   // run_ returned, waiting for doContinue()
+        kDone
+    };
+
+    LoopState(const std::function<void(DeferLoop &loop)> &run, const Defer &defer)
+        : run_(run)
+        , defer_(defer)
+        , word_(kRunning) {
+    }
+
+    PROMISE_API void run();
+    PROMISE_API void doContinue(size_t iteration);
+    // Returns true if the loop is ended by this call
+    PROMISE_API bool finish(size_t iteration);
+
+    std::function<void(DeferLoop &loop)> run_;
+    Defer                                defer_;
+    std::atomic<size_t>                  word_;
 };
 
 class DeferLoop {
@@ -152,60 +877,181 @@ public:
     template<typename ...ARGS,
         typename std::enable_if<!is_one_any<ARGS...>::value>::type *dummy = nullptr>
     inline void doBreak(ARGS &&...args) const {
-        doBreak(any{ std::vector<any>{std::forward<ARGS>(args)...} });
+        doBreak(makeArguments(std::forward<ARGS>(args)...));
     }
 
     template<typename ...ARGS,
         typename std::enable_if<!is_one_any<ARGS...>::value>::type *dummy = nullptr>
     inline void reject(ARGS &&...args) const {
-        reject(any{ std::vector<any>{std::forward<ARGS>(args)...} });
+        reject(makeArguments(std::forward<ARGS>(args)...));
     }
 
     PROMISE_API void doContinue() const;
     PROMISE_API void doBreak(const any &arg) const;
     PROMISE_API void reject(const any &arg) const;
+    PROMISE_API void doBreak(any &&arg) const;
+    PROMISE_API void reject(any &&arg) const;
 
 
     PROMISE_API Promise getPromise() const;
 
 private:
-    friend PROMISE_API Promise doWhile(const std::function<void(DeferLoop &loop)> &run);
-    PROMISE_API DeferLoop(const Defer &cb);
-    Defer defer_;
+    friend struct LoopState;
+    PROMISE_API DeferLoop(const IntrusivePtr<LoopState> &state, size_t iteration);
+    IntrusivePtr<LoopState> state_;
+    size_t                  iteration_;
 };
 
+/*
+ * Settles many Defer objects at once. run() keeps the lock taken for a
+ * defer to settle the next one if it is guarded by the same lock, so the
+ * defers of joined promises share one lock round trip. The continuations
+ * are called with the locks released, as Defer::resolve() does. A defer
+ * settled already, or added twice, is settled by the first one.
+ */
+class SettleBatch {
+public:
+    // A defer moved in is not copied
+    template<typename ...ARGS,
+        typename std::enable_if<!is_one_any<ARGS...>::value>::type *dummy = nullptr>
+    inline void resolve(Defer defer, ARGS &&...args) {
+        resolve(std::move(defer), makeArguments(std::forward<ARGS>(args)...));
+    }
+
+    template<typename ...ARGS,
+        typename std::enable_if<!is_one_any<ARGS...>::value>::type *dummy = nullptr>
+    inline void reject(Defer defer, ARGS &&...args) {
+        reject(std::move(defer), makeArguments(std::forward<ARGS>(args)...));
+    }
+
+    PROMISE_API void resolve(Defer defer, const any &arg);
+    PROMISE_API void reject(Defer defer, const any &arg);
+    PROMISE_API void resolve(Defer defer, any &&arg);
+    PROMISE_API void reject(Defer defer, any &&arg);
+
+    // Settles the defers added, the batch is empty after it
+    PROMISE_API void run();
+
+    inline void reserve(size_t size) { items_.reserve(size); }
+    inline size_t size() const { return items_.size(); }
+    inline bool empty() const { return items_.empty(); }
+
+private:
+    struct Item {
+        Defer     defer_;
+        TaskState state_;
+        any       value_;
+    };
+    std::vector<Item> items_;
+};
+
+/*
+ * Executor decides where a continuation runs. It wraps any object with
+ * member post(std::function<void()>) by reference, or a post function.
+ * A default constructed Executor runs the continuation inline, in the
+ * thread which settles the promise.
+ */
+class Executor {
+public:
+    typedef std::function<void()> Function;
+    typedef std::function<void(Function &&)> PostFunction;
+
+    Executor() {
+    }
+
+    // The executor object must outlive the continuations posted to it
+    template<typename EXECUTOR,
+        typename std::enable_if<!std::is_same<typename std::remove_cv<EXECUTOR>::type, Executor>::value>::type *dummy = nullptr,
+        typename = decltype(std::declval<EXECUTOR &>().post(std::declval<Function>()))>
+    explicit Executor(EXECUTOR &executor)
+        : post_([&executor](Function &&func) {
+            executor.post(std::move(func));
+        }) {
+    }
+
+    explicit Executor(PostFunction &&post)
+        : post_(std::move(post)) {
+    }
+
+    inline void post(Function &&func) const {
+        if (post_) post_(std::move(func));
+        else func();
+    }
+
+    inline bool isInline() const {
+        return !post_;
+    }
+
+private:
+    PostFunction post_;
+};
+
+// Run the continuations inline
+inline Executor inlineExecutor() {
+    return Executor();
+}
+
 class Promise {
 public:
     PROMISE_API Promise &then(const any &deferOrPromiseOrOnResolved);
     PROMISE_API Promise &then(const any &onResolved, const any &onRejected);
     PROMISE_API Promise &fail(const any &onRejected);
+    PROMISE_API Promise &then(any &&deferOrPromiseOrOnResolved);
+    PROMISE_API Promise &then(any &&onResolved, any &&onRejected);
+    PROMISE_API Promise &fail(any &&onRejected);
     PROMISE_API Promise &always(const any &onAlways);
     PROMISE_API Promise &finally(const any &onFinally);
 
+    // The handlers are called by executor, instead of the thread which settles the promise
+    PROMISE_API Promise &then(const Executor &executor, any &&onResolved, any &&onRejected);
+    // Continue the chain on executor
+    PROMISE_API Promise &via(const Executor &executor);
+
+    template<typename ON_RESOLVED>
+    inline Promise &then(const Executor &executor, ON_RESOLVED &&onResolved) {
+        return then(executor, any(std::forward<ON_RESOLVED>(onResolved)), any());
+    }
+    template<typename ON_RESOLVED, typename ON_REJECTED>
+    inline Promise &then(const Executor &executor, ON_RESOLVED &&onResolved, ON_REJECTED &&onRejected) {
+        return then(executor, any(std::forward<ON_RESOLVED>(onResolved)), any(std::forward<ON_REJECTED>(onRejected)));
+    }
+    template<typename ON_REJECTED>
+    inline Promise &fail(const Executor &executor, ON_REJECTED &&onRejected) {
+        return then(executor, any(), any(std::forward<ON_REJECTED>(onRejected)));
+    }
+
     template<typename ...ARGS,
         typename std::enable_if<!is_one_any<ARGS...>::value>::type *dummy = nullptr>
     inline void resolve(ARGS &&...args) const {
-        resolve(any{ std::vector<any>{std::forward<ARGS>(args)...} });
+        resolve(makeArguments(std::forward<ARGS>(args)...));
     }
     template<typename ...ARGS,
         typename std::enable_if<!is_one_any<ARGS...>::value>::type *dummy = nullptr>
     inline void reject(ARGS &&...args) const {
-        reject(any{ std::vector<any>{std::forward<ARGS>(args)...} });
+        reject(makeArguments(std::forward<ARGS>(args)...));
     }
 
     PROMISE_API void resolve(const any &arg) const;
     PROMISE_API void reject(const any &arg) const;
+    PROMISE_API void resolve(any &&arg) const;
+    PROMISE_API void reject(any &&arg) const;
+
+    // Reject the pending promise by cancelled_error, and stop the work
+    // registered by Defer::onCancel() of it and the joined promises
+    PROMISE_API void cancel() const;
 
     PROMISE_API void clear();
     PROMISE_API operator bool() const;
 
     PROMISE_API void dump() const;
 
-    std::shared_ptr<SharedPromise> sharedPromise_;
+    IntrusivePtr<SharedPromise> sharedPromise_;
 };
 
 
 PROMISE_API Promise newPromise(const std::function<void(Defer &defer)> &run);
+// The promise is cancelled when token is cancelled
+PROMISE_API Promise newPromise(const std::function<void(Defer &defer)> &run, const CancellationToken &token);
 PROMISE_API Promise newPromise();
 PROMISE_API Promise doWhile(const std::function<void(DeferLoop &loop)> &run);
 template<typename ...ARGS>
@@ -221,22 +1067,96 @@ inline Promise reject(ARGS &&...args) {
 
 /* Returns a promise that resolves when all of the promises in the iterable
    argument have resolved, or rejects with the reason of the first passed
-   promise that rejects. */
+   promise that rejects. The values are passed as arguments in the order
+   of promises, so a handler may take them one by one, or take all of them
+   as const std::vector<any> &. */
+PROMISE_API Promise all(const std::vector<Promise> &promise_list);
 PROMISE_API Promise all(const std::list<Promise> &promise_list);
 template<typename PROMISE_LIST,
     typename std::enable_if<is_iterable<PROMISE_LIST>::value
                             && !std::is_same<PROMISE_LIST, std::list<Promise>>::value
+                            && !std::is_same<PROMISE_LIST, std::vector<Promise>>::value
     >::type *dummy = nullptr>
 inline Promise all(const PROMISE_LIST &promise_list) {
-    std::list<Promise> copy_list = { std::begin(promise_list), std::end(promise_list) };
+    std::vector<Promise> copy_list(std::begin(promise_list), std::end(promise_list));
     return all(copy_list);
 }
 template <typename PROMISE0, typename ... PROMISE_LIST, typename std::enable_if<!is_iterable<PROMISE0>::value>::type *dummy = nullptr>
 inline Promise all(PROMISE0 defer0, PROMISE_LIST ...promise_list) {
-    return all(std::list<Promise>{ defer0, promise_list ... });
+    return all(std::vector<Promise>{ defer0, promise_list ... });
 }
 
 
+// Result of a promise passed to allSettled()
+struct Settled {
+    bool isResolved() const {
+        return state_ == TaskState::kResolved;
+    }
+
+    TaskState state_;   // kResolved or kRejected
+    any       value_;   // the value if resolved, or the reason
+};
+
+/* Returns a promise that resolves when all of the promises in the iterable
+   argument are settled, with const std::vector<Settled> & in the order of
+   promises. It never rejects. */
+PROMISE_API Promise allSettled(const std::vector<Promise> &promise_list);
+template<typename PROMISE_LIST,
+    typename std::enable_if<is_iterable<PROMISE_LIST>::value
+                            && !std::is_same<PROMISE_LIST, std::vector<Promise>>::value
+    >::type *dummy = nullptr>
+inline Promise allSettled(const PROMISE_LIST &promise_list) {
+    std::vector<Promise> copy_list(std::begin(promise_list), std::end(promise_list));
+    return allSettled(copy_list);
+}
+template <typename PROMISE0, typename ... PROMISE_LIST, typename std::enable_if<!is_iterable<PROMISE0>::value>::type *dummy = nullptr>
+inline Promise allSettled(PROMISE0 defer0, PROMISE_LIST ...promise_list) {
+    return allSettled(std::vector<Promise>{ defer0, promise_list ... });
+}
+
+// What anyOf() and some() do to the promises still pending once settled
+enum class LoserPolicy {
+    kKeep,      // leave them as they are
+    kCancel,    // call Promise::cancel()
+    kReject,    // reject them without argument, as raceAndReject() does
+    kResolve    // resolve them without argument, as raceAndResolve() does
+};
+
+/* Returns a promise that resolves with the value of the first resolved
+   promise in the iterable argument, or rejects with aggregate_error if
+   all of them are rejected. */
+PROMISE_API Promise anyOf(const std::vector<Promise> &promise_list, LoserPolicy losers = LoserPolicy::kKeep);
+template<typename PROMISE_LIST,
+    typename std::enable_if<is_iterable<PROMISE_LIST>::value
+                            && !std::is_same<PROMISE_LIST, std::vector<Promise>>::value
+    >::type *dummy = nullptr>
+inline Promise anyOf(const PROMISE_LIST &promise_list, LoserPolicy losers = LoserPolicy::kKeep) {
+    std::vector<Promise> copy_list(std::begin(promise_list), std::end(promise_list));
+    return anyOf(copy_list, losers);
+}
+template <typename PROMISE0, typename ... PROMISE_LIST, typename std::enable_if<!is_iterable<PROMISE0>::value>::type *dummy = nullptr>
+inline Promise anyOf(PROMISE0 defer0, PROMISE_LIST ...promise_list) {
+    return anyOf(std::vector<Promise>{ defer0, promise_list ... });
+}
+
+/* Returns a promise that resolves when "count" promises in the iterable
+   argument are resolved, with their values as arguments in the order they
+   were resolved, or rejects with aggregate_error as soon as "count" can
+   not be reached any more. */
+PROMISE_API Promise some(size_t count, const std::vector<Promise> &promise_list, LoserPolicy losers = LoserPolicy::kKeep);
+template<typename PROMISE_LIST,
+    typename std::enable_if<is_iterable<PROMISE_LIST>::value
+                            && !std::is_same<PROMISE_LIST, std::vector<Promise>>::value
+    >::type *dummy = nullptr>
+inline Promise some(size_t count, const PROMISE_LIST &promise_list, LoserPolicy losers = LoserPolicy::kKeep) {
+    std::vector<Promise> copy_list(std::begin(promise_list), std::end(promise_list));
+    return some(count, copy_list, losers);
+}
+template <typename PROMISE0, typename ... PROMISE_LIST, typename std::enable_if<!is_iterable<PROMISE0>::value>::type *dummy = nullptr>
+inline Promise some(size_t count, PROMISE0 defer0, PROMISE_LIST ...promise_list) {
+    return some(count, std::vector<Promise>{ defer0, promise_list ... });
+}
+
 /* returns a promise that resolves or rejects as soon as one of
 the promises in the iterable resolves or rejects, with the value
 or reason from that promise. */
@@ -284,6 +1204,67 @@ inline Promise raceAndResolve(PROMISE0 defer0, PROMISE_LIST ...promise_list) {
     return raceAndResolve(std::list<Promise>{ defer0, promise_list ... });
 }
 
+/* Resolves or rejects all the defers with the same arguments, by a
+   SettleBatch */
+PROMISE_API void resolveAll(const std::vector<Defer> &defers, const any &arg);
+PROMISE_API void rejectAll(const std::vector<Defer> &defers, const any &arg);
+template<typename ...ARGS,
+    typename std::enable_if<!is_one_any<ARGS...>::value>::type *dummy = nullptr>
+inline void resolveAll(const std::vector<Defer> &defers, ARGS &&...args) {
+    resolveAll(defers, makeArguments(std::forward<ARGS>(args)...));
+}
+template<typename ...ARGS,
+    typename std::enable_if<!is_one_any<ARGS...>::value>::type *dummy = nullptr>
+inline void rejectAll(const std::vector<Defer> &defers, ARGS &&...args) {
+    rejectAll(defers, makeArguments(std::forward<ARGS>(args)...));
+}
+
+/* Calls launch(index) for each index in [0, size), with at most "limit"
+   promises returned by launch in flight. The next index is launched as one
+   of them is resolved. Resolves with the values as arguments in the order
+   of index, or rejects with the first reason, then no more is launched.
+   A "limit" of 0 is taken as 1. */
+PROMISE_API Promise mapLimit(size_t size, size_t limit, const std::function<Promise(size_t index)> &launch);
+// Same as mapLimit(), and resolves without value
+PROMISE_API Promise forEachLimit(size_t size, size_t limit, const std::function<Promise(size_t index)> &launch);
+
+// Maps an index to func(item) of the range, which must outlive the launches
+template<typename RANGE, typename FUNC>
+inline std::function<Promise(size_t index)> rangeLauncher(const RANGE &range, FUNC func, std::random_access_iterator_tag) {
+    auto first = std::begin(range);
+    return [first, func](size_t index) -> Promise {
+        return func(first[index]);
+    };
+}
+template<typename RANGE, typename FUNC>
+inline std::function<Promise(size_t index)> rangeLauncher(const RANGE &range, FUNC func, std::input_iterator_tag) {
+    typedef decltype(std::begin(range)) Iterator;
+    std::shared_ptr<std::vector<Iterator>> items = std::make_shared<std::vector<Iterator>>();
+    for (auto it = std::begin(range); it != std::end(range); ++it)
+        items->push_back(it);
+    return [items, func](size_t index) -> Promise {
+        return func(*(*items)[index]);
+    };
+}
+
+/* mapLimit() and forEachLimit() over an iterable, func(item) returns the
+   promise of the item. The items are taken by reference, so the range must
+   outlive the returned promise. */
+template<typename RANGE, typename FUNC,
+    typename std::enable_if<is_iterable<RANGE>::value>::type *dummy = nullptr>
+inline Promise mapLimit(const RANGE &range, size_t limit, FUNC func) {
+    typedef typename std::iterator_traits<decltype(std::begin(range))>::iterator_category Category;
+    size_t size = static_cast<size_t>(std::distance(std::begin(range), std::end(range)));
+    return mapLimit(size, limit, rangeLauncher(range, func, Category()));
+}
+template<typename RANGE, typename FUNC,
+    typename std::enable_if<is_iterable<RANGE>::value>::type *dummy = nullptr>
+inline Promise forEachLimit(const RANGE &range, size_t limit, FUNC func) {
+    typedef typename std::iterator_traits<decltype(std::begin(range))>::iterator_category Category;
+    size_t size = static_cast<size_t>(std::distance(std::begin(range), std::end(range)));
+    return forEachLimit(size, limit, rangeLauncher(range, func, Category()));
+}
+
 inline void handleUncaughtException(const any &onUncaughtException) {
     PromiseHolder::handleUncaughtException(onUncaughtException);
 }
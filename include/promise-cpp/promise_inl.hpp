@@ -19,25 +19,19 @@ static inline void healthyCheck(int line, PromiseHolder *promiseHolder) {
         throw std::runtime_error("");
     }
 
-    for (const auto &owner_ : promiseHolder->owners_) {
-        auto owner = owner_.lock();
-        if (owner && owner->promiseHolder_.get() != promiseHolder) {
-            fprintf(stderr, "line = %d, %d, owner->promiseHolder_ = %p, promiseHolder = %p\n",
-                line, __LINE__,
-                owner->promiseHolder_.get(),
-                promiseHolder);
-            throw std::runtime_error("");
-        }
+    if (promiseHolder->getForward() && !promiseHolder->pendingTasks_.empty()) {
+        fprintf(stderr, "line = %d, %d, promiseHolder = %p is forwarded with tasks\n", line, __LINE__, promiseHolder);
+        throw std::runtime_error("");
     }
 
-    for (const std::shared_ptr<Task> &task : promiseHolder->pendingTasks_) {
+    for (const IntrusivePtr<Task> &task : promiseHolder->pendingTasks_) {
         if (!task) {
             fprintf(stderr, "line = %d, %d, promiseHolder = %p, task is null\n", line, __LINE__, promiseHolder);
             throw std::runtime_error("");
         }
         if (task->state_ != TaskState::kPending) {
             fprintf(stderr, "line = %d, %d, promiseHolder = %p, task = %p, task->state_ = %d\n", line, __LINE__,
-                promiseHolder, task.get(), (int)task->state_);
+                promiseHolder, task.get(), (int)(TaskState)task->state_);
             throw std::runtime_error("");
         }
         if (task->promiseHolder_.lock().get() != promiseHolder) {
@@ -67,11 +61,8 @@ void SharedPromise::dump() const {
 
 void PromiseHolder::dump() const {
 #ifndef NDEBUG
-    printf("PromiseHolder = %p, owners = %d, pendingTasks = %d\n", this, (int)this->owners_.size(), (int)this->pendingTasks_.size());
-    for (const auto &owner_ : owners_) {
-        auto owner = owner_.lock();
-        printf("  owner = %p\n", owner.get());
-    }
+    printf("PromiseHolder = %p, forward = %p, rank = %d, pendingTasks = %d\n", this,
+        this->getForward().get(), (int)this->rank_, (int)this->pendingTasks_.size());
     for (const auto &task : pendingTasks_) {
         if (task) {
             auto promiseHolder = task->promiseHolder_.lock();
@@ -84,192 +75,464 @@ void PromiseHolder::dump() const {
 #endif
 }
 
-static inline void join(const std::shared_ptr<PromiseHolder> &left, const std::shared_ptr<PromiseHolder> &right) {
+IntrusivePtr<PromiseHolder> Task::getPromiseHolder() const {
+#if PROMISE_MULTITHREAD
+    std::lock_guard<SpinLock> lock(spinLock_);
+#endif
+    return promiseHolder_.lock();
+}
+
+void Task::setPromiseHolder(const IntrusivePtr<PromiseHolder> &promiseHolder) {
+    // The old one is released after unlocked
+    IntrusiveWeakPtr<PromiseHolder> old(promiseHolder);
+#if PROMISE_MULTITHREAD
+    std::lock_guard<SpinLock> lock(spinLock_);
+#endif
+    promiseHolder_.swap(old);
+}
+
+IntrusivePtr<PromiseHolder> SharedPromise::getPromiseHolder() const {
+#if PROMISE_MULTITHREAD
+    std::lock_guard<SpinLock> lock(spinLock_);
+#endif
+    return promiseHolder_;
+}
+
+void SharedPromise::setPromiseHolder(const IntrusivePtr<PromiseHolder> &promiseHolder) {
+    IntrusivePtr<PromiseHolder> old(promiseHolder);
+#if PROMISE_MULTITHREAD
+    std::lock_guard<SpinLock> lock(spinLock_);
+#endif
+    promiseHolder_.swap(old);
+}
+
+IntrusivePtr<PromiseHolder> PromiseHolder::getForward() const {
+#if PROMISE_MULTITHREAD
+    std::lock_guard<SpinLock> lock(spinLock_);
+#endif
+    return forward_;
+}
+
+void PromiseHolder::setForward(const IntrusivePtr<PromiseHolder> &forward) {
+    IntrusivePtr<PromiseHolder> old(forward);
+#if PROMISE_MULTITHREAD
+    std::lock_guard<SpinLock> lock(spinLock_);
+#endif
+    forward_.swap(old);
+}
+
+#if PROMISE_MULTITHREAD
+// Marks the inbox of a holder joined to another one, then() locks the root then
+static inline Task *closedInbox() {
+    return reinterpret_cast<Task *>(uintptr_t(1));
+}
+
+// Add the task of then() to the holder without locking it, returns false if
+// the holder was joined to another one. The caller of the tasks takes the
+// inbox after setting the state of the holder, and then() checks the state
+// in call() after pushing, so one of them always finds the task.
+static inline bool pushInbox(PromiseHolder &promiseHolder, Task *task) {
+    task->retain();     // kept by the inbox
+    Task *head = promiseHolder.inbox_.load(std::memory_order_relaxed);
+    do {
+        if (head == closedInbox()) {
+            task->release();
+            return false;
+        }
+        task->next_ = head;
+    } while (!promiseHolder.inbox_.compare_exchange_weak(head, task));
+    return true;
+}
+
+// Move the tasks in the inbox to pendingTasks_ in the order they were added,
+// with the holder locked. The inbox is closed if the holder is forwarded.
+static inline void takeInbox(PromiseHolder &promiseHolder, bool close = false) {
+    if (!close && promiseHolder.inbox_.load() == nullptr) return;
+    Task *head = promiseHolder.inbox_.exchange(close ? closedInbox() : nullptr);
+    if (head == closedInbox()) return;
+
+    Task *reversed = nullptr;
+    while (head != nullptr) {
+        Task *next = head->next_;
+        head->next_ = reversed;
+        reversed = head;
+        head = next;
+    }
+    while (reversed != nullptr) {
+        Task *next = reversed->next_;
+        reversed->next_ = nullptr;
+        promiseHolder.pendingTasks_.push_back(IntrusivePtr<Task>(reversed));
+        reversed->release();
+        reversed = next;
+    }
+}
+#else
+static inline void takeInbox(PromiseHolder &, bool = false) {
+}
+#endif
+
+/*
+ * Join right to left, the tasks of right are called after the tasks of left
+ * with the state of left. Both of them are locked if PROMISE_MULTITHREAD.
+ *
+ * The holder of lower rank is forwarded to the other one, which is returned
+ * as the root, and only the tasks of the forwarded one are moved. The
+ * promises owning it are not changed here, they find the root by forward_
+ * in obtainLock(). In a loop of returning promises, the returned one is
+ * forwarded to the holder of the chain, so the cost does not grow with the
+ * count of iterations.
+ */
+static inline IntrusivePtr<PromiseHolder> join(const IntrusivePtr<PromiseHolder> &left, const IntrusivePtr<PromiseHolder> &right) {
     healthyCheck(__LINE__, left.get());
     healthyCheck(__LINE__, right.get());
     //left->dump();
     //right->dump();
 
-    for (const std::shared_ptr<Task> &task : right->pendingTasks_) {
-        task->promiseHolder_ = left;
-    }
-    left->pendingTasks_.splice(left->pendingTasks_.end(), right->pendingTasks_);
+    bool toRight = (left->rank_ <= right->rank_);
+    const IntrusivePtr<PromiseHolder> &root = (toRight ? right : left);
+    const IntrusivePtr<PromiseHolder> &other = (toRight ? left : right);
+    if (left->rank_ == right->rank_)
+        ++root->rank_;
 
-    std::list<std::weak_ptr<SharedPromise>> owners;
-    owners.splice(owners.end(), right->owners_);
+    takeInbox(*root);
+    takeInbox(*other, true);
+    for (const IntrusivePtr<Task> &task : other->pendingTasks_) {
+        task->setPromiseHolder(root);
+    }
+    if (toRight) {
+        PromiseHolder::TaskList tasks;
+        tasks.splice(left->pendingTasks_);
+        tasks.splice(right->pendingTasks_);
+        right->pendingTasks_.splice(tasks);
+        right->state_ = (TaskState)left->state_;
+        right->busy_ = left->busy_;
+        right->value_ = std::move(left->value_);
+        left->value_.clear();
+    }
+    else {
+        left->pendingTasks_.splice(right->pendingTasks_);
+    }
 
     // Looked on resolved if the PromiseHolder was joined to another,
     // so that it will not throw onUncaughtException when destroyed.
-    right->state_ = TaskState::kResolved;
-
-    if(owners.size() > 100) {
-        fprintf(stderr, "Maybe memory leak, too many promise owners: %d", (int)owners.size());
-    }
-
-    for (const std::weak_ptr<SharedPromise> &owner_ : owners) {
-        std::shared_ptr<SharedPromise> owner = owner_.lock();
-        if (owner) {
-            owner->promiseHolder_ = left;
-            left->owners_.push_back(owner);
+    other->state_ = TaskState::kResolved;
+
+    // Cancelling the chain cancels the joined promise too
+    IntrusivePtr<CancelState> cancel = left->cancel_;
+    if (right->cancel_) {
+        if (!cancel)
+            cancel = right->cancel_;
+        else if (cancel != right->cancel_ && !right->cancel_->cancelled_)
+            cancel->link(right->cancel_);
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<std::mutex> lock(right->cancel_->mutex_);
+#endif
+            right->cancel_->promiseHolder_ = root;
         }
     }
+    if (cancel && cancel != right->cancel_) {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(cancel->mutex_);
+#endif
+        cancel->promiseHolder_ = root;
+    }
+    other->cancel_.reset();
+    root->cancel_ = cancel;
+
+    other->setForward(root);
 
     //left->dump();
     //right->dump();
-    //fprintf(stderr, "left->promiseHolder_->owners_ size = %d\n", (int)left->promiseHolder_->owners_.size());
-
 
-    healthyCheck(__LINE__, left.get());
-    healthyCheck(__LINE__, right.get());
+    healthyCheck(__LINE__, root.get());
+    healthyCheck(__LINE__, other.get());
+    return root;
 }
 
 //Unlock and then lock
 #if PROMISE_MULTITHREAD
 struct unlock_guard_t {
-    inline unlock_guard_t(std::shared_ptr<Mutex> mutex)
+    inline unlock_guard_t(Mutex &mutex)
         : mutex_(mutex)
-        , lock_count_(mutex->lock_count()) {
-        mutex_->unlock(lock_count_);
+        , lock_count_(mutex.lock_count()) {
+        mutex_.unlock(lock_count_);
     }
     inline ~unlock_guard_t() {
-        mutex_->lock(lock_count_);
+        mutex_.lock(lock_count_);
     }
-    std::shared_ptr<Mutex> mutex_;
+    Mutex &mutex_;
     size_t lock_count_;
 };
 #endif
 
-static inline void call(std::shared_ptr<Task> task) {
-    std::shared_ptr<PromiseHolder> promiseHolder; //Can hold the temporarily created promise
+// Handler of a task added by then(executor, ...), the task is called in
+// the executor, and the handler is empty for via(executor).
+struct ExecutorHandler {
+    Executor executor_;
+    any handler_;
+};
+
+static inline any onExecutor(const Executor &executor, any &&handler) {
+    if (handler.empty() || handler.type() == type_id<std::nullptr_t>())
+        return std::move(handler);
+    ExecutorHandler executorHandler = { executor, std::move(handler) };
+    return any(std::move(executorHandler));
+}
+
+static inline any &handlerOf(any &handler) {
+    if (handler.type() == type_id<ExecutorHandler>())
+        return handler.cast<ExecutorHandler &>().handler_;
+    return handler;
+}
+
+// Returns the executor if the task will call its handler in it
+static inline const Executor *executorOf(Task &task, PromiseHolder &promiseHolder) {
+    bool isResolved = (promiseHolder.state_ == TaskState::kResolved);
+    any &handler = (isResolved ? task.onResolved_ : task.onRejected_);
+    if (handler.type() != type_id<ExecutorHandler>())
+        return nullptr;
+    ExecutorHandler &executorHandler = handler.cast<ExecutorHandler &>();
+    if (!isResolved && !executorHandler.handler_.empty()
+        && !executorHandler.handler_.accepts(promiseHolder.value_))
+        return nullptr;
+    return &executorHandler.executor_;
+}
+
+static inline void call(IntrusivePtr<Task> task, bool queued = false, bool posted = false);
+
+// Call the task again in the executor, with the settled state. The state is
+// shared by the copies of the posted function. If the executor destroys them
+// without running any, e.g. it is stopped with functions not run yet, the
+// handler is skipped and the continuation is rejected by cancelled_error.
+struct ExecutorHopState : public RefCounted<ExecutorHopState> {
+    ExecutorHopState(const IntrusivePtr<Task> &task, const IntrusivePtr<PromiseHolder> &promiseHolder, TaskState state)
+        : task_(task)
+        , promiseHolder_(promiseHolder)
+        , state_(state)
+        , called_(false) {
+    }
+
+    void resume(bool called) {
+        any onResolved, onRejected;  // released after unlocked
+        // The holder may be joined to another one in the executor, the task
+        // is moved to the root by join() with both of them locked
+        IntrusivePtr<PromiseHolder> promiseHolder;
+        while (true) {
+            promiseHolder = task_->getPromiseHolder();
+            if (!promiseHolder) return;
+#if PROMISE_MULTITHREAD
+            std::lock_guard<Mutex> lock(promiseHolder->mutex_);
+#endif
+            if (task_->getPromiseHolder() != promiseHolder) continue;
+            promiseHolder->busy_ = false;
+            if (called) {
+                promiseHolder->state_ = state_;
+            }
+            else {
+                onResolved = std::move(task_->onResolved_);
+                onRejected = std::move(task_->onRejected_);
+                task_->onResolved_.clear();
+                task_->onRejected_.clear();
+                promiseHolder->state_ = TaskState::kRejected;
+                promiseHolder->value_ = std::make_exception_ptr(cancelled_error());
+            }
+            break;
+        }
+        call(task_, false, true);
+    }
+
+    inline void dispose() {
+        if (!called_)
+            resume(false);
+    }
+
+    IntrusivePtr<Task> task_;
+    IntrusivePtr<PromiseHolder> promiseHolder_; // keeps the holder alive until called
+    TaskState state_;
+    bool called_;
+};
+
+struct ExecutorHop {
+    void operator()() {
+        state_->called_ = true;
+        state_->resume(true);
+    }
+    IntrusivePtr<ExecutorHopState> state_;
+};
+
+// A queued microtask is skipped if it is not in front, it will be done by
+// the loop below when the task in front is called.
+// A posted task is called in its executor already.
+static inline void call(IntrusivePtr<Task> task, bool queued, bool posted) {
+    IntrusivePtr<PromiseHolder> promiseHolder; //Can hold the temporarily created promise
+    any_exception_scope exceptionScope;         // the rejections looked up by the handlers
     while (true) {
-        promiseHolder = task->promiseHolder_.lock();
+        promiseHolder = task->getPromiseHolder();
         if (!promiseHolder) return;
 
+        // Lock free check, the task was done or the promise is not settled,
+        // and whoever settles the promise will run the pending tasks later.
+        if (task->state_ != TaskState::kPending) return;
+        if (promiseHolder->state_ == TaskState::kPending) return;
+
         // lock for 1st stage
         {
 #if PROMISE_MULTITHREAD
-            std::shared_ptr<Mutex> mutex = promiseHolder->mutex_;
-            std::unique_lock<Mutex> lock(*mutex);
+            // The locked holder is kept until unlocked, promiseHolder may be changed by join()
+            IntrusivePtr<PromiseHolder> lockedHolder = promiseHolder;
+            Mutex &mutex = lockedHolder->mutex_;
+            std::lock_guard<Mutex> lock(mutex);
 #endif
 
             if (task->state_ != TaskState::kPending) return;
             if (promiseHolder->state_ == TaskState::kPending) return;
+            if (promiseHolder->state_ == TaskState::kRejected)
+                exceptionScope.used_ = true;
 
-            std::list<std::shared_ptr<Task>> &pendingTasks = promiseHolder->pendingTasks_;
+            takeInbox(*promiseHolder);
+            PromiseHolder::TaskList &pendingTasks = promiseHolder->pendingTasks_;
             //promiseHolder->dump();
-
-#if PROMISE_MULTITHREAD
-            while (pendingTasks.front() != task) {
-                mutex->cond_.wait<std::unique_lock<Mutex>>(lock);
+            // The task was moved to another holder by join() before locked
+            if (pendingTasks.empty()) continue;
+            if (pendingTasks.front() != task) {
+                if (queued) return;
+                // No handler of this holder is running, or the state would be
+                // pending, so the tasks in front are waiting for their callers.
+                // Hand off: call them here in order, and this task is reached
+                // by the loop below, instead of waiting for the other callers.
+                task = pendingTasks.front();
+                posted = false;
             }
-#else
-            assert(pendingTasks.front() == task);
-#endif
+            if (!posted) {
+                const Executor *executor = executorOf(*task, *promiseHolder);
+                if (executor != nullptr) {
+                    // The other callers return on the pending state, until it is restored in the executor
+                    ExecutorHop hop = { makeIntrusive<ExecutorHopState>(task, promiseHolder, (TaskState)promiseHolder->state_) };
+                    promiseHolder->state_ = TaskState::kPending;
+                    promiseHolder->busy_ = true;
+                    executor->post(std::move(hop));
+                    return;
+                }
+            }
+            posted = false;
+
             pendingTasks.pop_front();
-            task->state_ = promiseHolder->state_;
+            task->state_ = (TaskState)promiseHolder->state_;
+            any &onResolved = handlerOf(task->onResolved_);
+            any &onRejected = handlerOf(task->onRejected_);
             //promiseHolder->dump();
 
             try {
                 if (promiseHolder->state_ == TaskState::kResolved) {
-                    if (task->onResolved_.empty()
-                        || task->onResolved_.type() == type_id<std::nullptr_t>()) {
+                    if (onResolved.empty()
+                        || onResolved.type() == type_id<std::nullptr_t>()) {
                         //to next resolved task
                     }
                     else {
+                        // The value is consumed by the handler
+                        any arg = std::move(promiseHolder->value_);
                         promiseHolder->state_ = TaskState::kPending; // avoid recursive task using this state
+                        promiseHolder->busy_ = true;
 #if PROMISE_MULTITHREAD
-                        std::shared_ptr<Mutex> mutex0 = nullptr;
+                        IntrusivePtr<PromiseHolder> locked0;
                         auto call = [&]() -> any {
                             unlock_guard_t lock_inner(mutex);
-                            const any &value = task->onResolved_.call(promiseHolder->value_);
+                            any value = onResolved.call(std::move(arg));
                             // Make sure the returned promised is locked before than "mutex"
                             if (value.type() == type_id<Promise>()) {
                                 Promise &promise = value.cast<Promise &>();
-                                mutex0 = promise.sharedPromise_->obtainLock();
+                                locked0 = promise.sharedPromise_->obtainLock();
                             }
                             return value;
                         };
-                        const any &value = call();
+                        any value = call();
+                        promiseHolder->busy_ = false;
 
-                        if (mutex0 == nullptr) {
-                            promiseHolder->value_ = value;
+                        if (locked0 == nullptr) {
+                            promiseHolder->value_ = std::move(value);
                             promiseHolder->state_ = TaskState::kResolved;
                         }
                         else {
                             // join the promise
-                            Promise &promise = value.cast<Promise &>();
-                            std::lock_guard<Mutex> lock0(*mutex0, std::adopt_lock_t());
-                            join(promise.sharedPromise_->promiseHolder_, promiseHolder);
-                            promiseHolder = promise.sharedPromise_->promiseHolder_;
+                            std::lock_guard<Mutex> lock0(locked0->mutex_, std::adopt_lock_t());
+                            promiseHolder = join(locked0, promiseHolder);
                         }
 #else
-                        const any &value = task->onResolved_.call(promiseHolder->value_);
+                        any value = onResolved.call(std::move(arg));
+                        promiseHolder->busy_ = false;
 
                         if (value.type() != type_id<Promise>()) {
-                            promiseHolder->value_ = value;
+                            promiseHolder->value_ = std::move(value);
                             promiseHolder->state_ = TaskState::kResolved;
                         }
                         else {
                             // join the promise
                             Promise &promise = value.cast<Promise &>();
-                            join(promise.sharedPromise_->promiseHolder_, promiseHolder);
-                            promiseHolder = promise.sharedPromise_->promiseHolder_;
+                            promiseHolder = join(promise.sharedPromise_->obtainLock(), promiseHolder);
                         }
 #endif
                     }
                 }
                 else if (promiseHolder->state_ == TaskState::kRejected) {
-                    if (task->onRejected_.empty()
-                        || task->onRejected_.type() == type_id<std::nullptr_t>()) {
+                    if (onRejected.empty()
+                        || onRejected.type() == type_id<std::nullptr_t>()) {
                         //to next rejected task
                         //promiseHolder->value_ = promiseHolder->value_;
                         //promiseHolder->state_ = TaskState::kRejected;
                     }
+                    else if (!onRejected.accepts(promiseHolder->value_)) {
+                        //to next rejected task, argument type is not match
+                    }
                     else {
+                        // The value is consumed by the handler, or restored if not matched
+                        any arg = std::move(promiseHolder->value_);
                         try {
                             promiseHolder->state_ = TaskState::kPending; // avoid recursive task using this state
+                            promiseHolder->busy_ = true;
 #if PROMISE_MULTITHREAD
-                            std::shared_ptr<Mutex> mutex0 = nullptr;
+                            IntrusivePtr<PromiseHolder> locked0;
                             auto call = [&]() -> any {
                                 unlock_guard_t lock_inner(mutex);
-                                const any &value = task->onRejected_.call(promiseHolder->value_);
+                                any value = onRejected.call(std::move(arg));
                                 // Make sure the returned promised is locked before than "mutex"
                                 if (value.type() == type_id<Promise>()) {
                                     Promise &promise = value.cast<Promise &>();
-                                    mutex0 = promise.sharedPromise_->obtainLock();
+                                    locked0 = promise.sharedPromise_->obtainLock();
                                 }
                                 return value;
                             };
-                            const any &value = call();
+                            any value = call();
+                            promiseHolder->busy_ = false;
 
-                            if (mutex0 == nullptr) {
-                                promiseHolder->value_ = value;
+                            if (locked0 == nullptr) {
+                                promiseHolder->value_ = std::move(value);
                                 promiseHolder->state_ = TaskState::kResolved;
                             }
                             else {
                                 // join the promise
-                                Promise promise = value.cast<Promise>();
-                                std::lock_guard<Mutex> lock0(*mutex0, std::adopt_lock_t());
-                                join(promise.sharedPromise_->promiseHolder_, promiseHolder);
-                                promiseHolder = promise.sharedPromise_->promiseHolder_;
+                                std::lock_guard<Mutex> lock0(locked0->mutex_, std::adopt_lock_t());
+                                promiseHolder = join(locked0, promiseHolder);
                             }
 #else
-                            const any &value = task->onRejected_.call(promiseHolder->value_);
+                            any value = onRejected.call(std::move(arg));
+                            promiseHolder->busy_ = false;
 
                             if (value.type() != type_id<Promise>()) {
-                                promiseHolder->value_ = value;
+                                promiseHolder->value_ = std::move(value);
                                 promiseHolder->state_ = TaskState::kResolved;
                             }
                             else {
                                 // join the promise
                                 Promise &promise = value.cast<Promise &>();
-                                join(promise.sharedPromise_->promiseHolder_, promiseHolder);
-                                promiseHolder = promise.sharedPromise_->promiseHolder_;
+                                promiseHolder = join(promise.sharedPromise_->obtainLock(), promiseHolder);
                             }
 #endif
                         }
                         catch (const bad_any_cast &) {
                             //just go through if argument type is not match
+                            promiseHolder->busy_ = false;
+                            promiseHolder->value_ = std::move(arg);
                             promiseHolder->state_ = TaskState::kRejected;
                         }
                     }
@@ -277,10 +540,12 @@ static inline void call(std::shared_ptr<Task> task) {
             }
             catch (const promise::bad_any_cast &ex) {
                 fprintf(stderr, "promise::bad_any_cast: %s -> %s", ex.from_.name(), ex.to_.name());
+                promiseHolder->busy_ = false;
                 promiseHolder->value_ = std::current_exception();
                 promiseHolder->state_ = TaskState::kRejected;
             }
             catch (...) {
+                promiseHolder->busy_ = false;
                 promiseHolder->value_ = std::current_exception();
                 promiseHolder->state_ = TaskState::kRejected;
             }
@@ -294,140 +559,1056 @@ static inline void call(std::shared_ptr<Task> task) {
         {
             // get next task
 #if PROMISE_MULTITHREAD
-            std::shared_ptr<Mutex> mutex = promiseHolder->mutex_;
-            std::lock_guard<Mutex> lock(*mutex);
+            std::lock_guard<Mutex> lock(promiseHolder->mutex_);
 #endif
-            std::list<std::shared_ptr<Task>> &pendingTasks2 = promiseHolder->pendingTasks_;
+            takeInbox(*promiseHolder);
+            PromiseHolder::TaskList &pendingTasks2 = promiseHolder->pendingTasks_;
             if (pendingTasks2.size() == 0) {
                 return;
             }
 
-            task = pendingTasks2.front();
+            task = pendingTasks2.front();
+        }
+    }
+}
+
+// Per thread queue of the microtask mode
+struct Microtasks {
+    static const size_t kCompactSize = 64;
+
+    Microtasks()
+        : enabled_(false)
+        , draining_(false)
+        , compactSize_(kCompactSize) {
+    }
+
+    static Microtasks &instance() {
+        static thread_local Microtasks microtasks;
+        return microtasks;
+    }
+
+    void push(const IntrusivePtr<Task> &task) {
+        Item item = { task, task->getPromiseHolder() };
+        queue_.push_back(std::move(item));
+        // A queued task may have been done by the loop in call() already,
+        // drop them so that a long chain does not grow the queue
+        if (queue_.size() >= compactSize_) {
+            queue_.remove_if([](const Item &queued) {
+                return queued.task_->state_ != TaskState::kPending;
+            });
+            size_t compactSize = queue_.size() * 2;
+            compactSize_ = (compactSize > kCompactSize ? compactSize : kCompactSize);
+        }
+    }
+
+    // Run the queue in a loop, unless it is being run by a caller already.
+    // Must be called without holding the lock of any promise.
+    void run() {
+        if (draining_ || queue_.empty()) return;
+
+        struct Drainer {
+            explicit Drainer(Microtasks &microtasks)
+                : microtasks_(microtasks) {
+                microtasks_.draining_ = true;
+            }
+            ~Drainer() {
+                microtasks_.draining_ = false;
+                microtasks_.compactSize_ = kCompactSize;
+            }
+            Microtasks &microtasks_;
+        } drainer(*this);
+
+        // The first one is called as it is without microtask mode
+        bool queued = false;
+        while (!queue_.empty()) {
+            Item next = std::move(queue_.front());
+            queue_.pop_front();
+            call(next.task_, queued);
+            queued = true;
+        }
+    }
+
+    // The promise holder is kept alive until the task is called, the Defer
+    // which settled it may be gone by then
+    struct Item {
+        IntrusivePtr<Task> task_;
+        IntrusivePtr<PromiseHolder> promiseHolder_;
+    };
+
+    bool enabled_;
+    bool draining_;
+    size_t compactSize_;
+    SmallVector<Item, 16> queue_;
+};
+
+// Thread affine mode of the calling thread
+struct ThreadAffinity {
+    static bool &enabled() {
+        static thread_local bool enabled = false;
+        return enabled;
+    }
+};
+
+void setThreadAffineMode(bool enabled) {
+    ThreadAffinity::enabled() = enabled;
+}
+
+bool getThreadAffineMode() {
+    return ThreadAffinity::enabled();
+}
+
+void setMicrotaskMode(bool enabled) {
+    Microtasks::instance().enabled_ = enabled;
+}
+
+bool getMicrotaskMode() {
+    return Microtasks::instance().enabled_;
+}
+
+// Call the task now, or queue it if a continuation is running in microtask mode
+static inline void dispatch(const IntrusivePtr<Task> &task) {
+    Microtasks &microtasks = Microtasks::instance();
+    if (!microtasks.enabled_) {
+        call(task);
+        return;
+    }
+    microtasks.push(task);
+    microtasks.run();
+}
+
+Defer::Defer(const IntrusivePtr<Task> &task) {
+    IntrusivePtr<SharedPromise> sharedPromise = makeIntrusive<SharedPromise>(task->getPromiseHolder());
+    IntrusivePtr<PromiseHolder> locked = sharedPromise->obtainLock();
+#if PROMISE_MULTITHREAD
+    std::lock_guard<Mutex> lock(locked->mutex_, std::adopt_lock_t());
+#endif
+
+    task_ = task;
+    sharedPromise_ = sharedPromise;
+}
+
+
+void Defer::resolve(const any &arg) const {
+    // Lock free check for the defer which was already resolved or rejected
+    if (task_->state_ != TaskState::kPending) return;
+    resolve(any(arg));
+}
+
+void Defer::reject(const any &arg) const {
+    // Lock free check for the defer which was already resolved or rejected
+    if (task_->state_ != TaskState::kPending) return;
+    reject(any(arg));
+}
+
+void Defer::resolve(any &&arg) const {
+    // Lock free check for the defer which was already resolved or rejected
+    if (task_->state_ != TaskState::kPending) return;
+#if PROMISE_MULTITHREAD
+    // The first one claims it, the others return without locking
+    if (task_->claimed_.exchange(true)) return;
+#endif
+
+    Microtasks &microtasks = Microtasks::instance();
+    CancelState::Callbacks dropped; // released after unlocked
+    {
+        // The winner still locks the holder: join(), cancellation and the
+        // hand-off in call() change state_, value_ and pendingTasks_ together
+        // under this lock. Uncontended it is one CAS on the word of the lock,
+        // none if it is biased to this thread, and call() below relocks it
+        // by counting the level only.
+        IntrusivePtr<PromiseHolder> promiseHolder = this->sharedPromise_->obtainLock();
+#if PROMISE_MULTITHREAD
+        std::lock_guard<Mutex> lock(promiseHolder->mutex_, std::adopt_lock_t());
+#endif
+
+        if (task_->state_ != TaskState::kPending) return;
+        promiseHolder->state_ = TaskState::kResolved;
+        promiseHolder->value_ = std::move(arg);
+        if (promiseHolder->cancel_)
+            promiseHolder->cancel_->settle(dropped);
+        if (!microtasks.enabled_) {
+            call(task_);
+            return;
+        }
+        microtasks.push(task_);
+    }
+    microtasks.run();
+}
+
+void Defer::reject(any &&arg) const {
+    // Lock free check for the defer which was already resolved or rejected
+    if (task_->state_ != TaskState::kPending) return;
+#if PROMISE_MULTITHREAD
+    // The first one claims it, the others return without locking
+    if (task_->claimed_.exchange(true)) return;
+#endif
+
+    Microtasks &microtasks = Microtasks::instance();
+    CancelState::Callbacks dropped; // released after unlocked
+    {
+        // Locked as in resolve()
+        IntrusivePtr<PromiseHolder> promiseHolder = this->sharedPromise_->obtainLock();
+#if PROMISE_MULTITHREAD
+        std::lock_guard<Mutex> lock(promiseHolder->mutex_, std::adopt_lock_t());
+#endif
+
+        if (task_->state_ != TaskState::kPending) return;
+        promiseHolder->state_ = TaskState::kRejected;
+        promiseHolder->value_ = std::move(arg);
+        if (promiseHolder->cancel_)
+            promiseHolder->cancel_->settle(dropped);
+        if (!microtasks.enabled_) {
+            call(task_);
+            return;
+        }
+        microtasks.push(task_);
+    }
+    microtasks.run();
+}
+
+
+Promise Defer::getPromise() const {
+    return Promise{ sharedPromise_ };
+}
+
+void SettleBatch::resolve(Defer defer, const any &arg) {
+    resolve(std::move(defer), any(arg));
+}
+
+void SettleBatch::reject(Defer defer, const any &arg) {
+    reject(std::move(defer), any(arg));
+}
+
+// The state of defer is checked in run(), so the promise is not touched here
+void SettleBatch::resolve(Defer defer, any &&arg) {
+    items_.push_back(Item{ std::move(defer), TaskState::kResolved, std::move(arg) });
+}
+
+void SettleBatch::reject(Defer defer, any &&arg) {
+    items_.push_back(Item{ std::move(defer), TaskState::kRejected, std::move(arg) });
+}
+
+/*
+ * Settles one defer of a batch as Defer::resolve() does. The lock taken
+ * for the previous defer is kept if the promise of this one points to the
+ * locked holder, and the locked holder is still a root. call() releases
+ * the lock around the handlers, which may join the locked holder to
+ * another one, so it is checked again for each defer.
+ */
+struct BatchSettler {
+    BatchSettler()
+        : microtasks_(Microtasks::instance()) {
+    }
+
+    ~BatchSettler() {
+#if PROMISE_MULTITHREAD
+        if (locked_ != nullptr) locked_->mutex_.unlock();
+#endif
+        microtasks_.run();
+    }
+
+    void settle(const Defer &defer, TaskState state, any &&arg) {
+        if (defer.task_->state_ != TaskState::kPending) return;
+#if PROMISE_MULTITHREAD
+        if (defer.task_->claimed_.exchange(true)) return;
+        if (locked_ == nullptr || locked_->getForward()
+            || locked_ != defer.sharedPromise_->getPromiseHolder()) {
+            if (locked_ != nullptr) locked_->mutex_.unlock();
+            locked_ = defer.sharedPromise_->obtainLock();
+        }
+        IntrusivePtr<PromiseHolder> &promiseHolder = locked_;
+#else
+        IntrusivePtr<PromiseHolder> promiseHolder = defer.sharedPromise_->obtainLock();
+#endif
+
+        if (defer.task_->state_ != TaskState::kPending) return;
+        promiseHolder->state_ = state;
+        promiseHolder->value_ = std::move(arg);
+        if (promiseHolder->cancel_)
+            promiseHolder->cancel_->settle(dropped_);
+        // The handlers are called with all the locks released by call()
+        if (!microtasks_.enabled_)
+            call(defer.task_);
+        else
+            microtasks_.push(defer.task_);
+    }
+
+    Microtasks             &microtasks_;
+    CancelState::Callbacks dropped_;    // released after unlocked
+#if PROMISE_MULTITHREAD
+    IntrusivePtr<PromiseHolder> locked_;
+#endif
+};
+
+void SettleBatch::run() {
+    // The continuations may add to this batch again
+    std::vector<Item> items;
+    items.swap(items_);
+    {
+        BatchSettler settler;
+        for (Item &item : items) {
+            // Released while the promise is still in cache
+            Defer defer = std::move(item.defer_);
+            settler.settle(defer, item.state_, std::move(item.value_));
+        }
+    }
+
+    // Keep the buffer for the next use
+    items.clear();
+    if (items_.empty())
+        items_.swap(items);
+}
+
+void resolveAll(const std::vector<Defer> &defers, const any &arg) {
+    BatchSettler settler;
+    for (const Defer &defer : defers)
+        settler.settle(defer, TaskState::kResolved, any(arg));
+}
+
+void rejectAll(const std::vector<Defer> &defers, const any &arg) {
+    BatchSettler settler;
+    for (const Defer &defer : defers)
+        settler.settle(defer, TaskState::kRejected, any(arg));
+}
+
+
+// Cancel state of the promise holder, created at the first use
+static IntrusivePtr<CancelState> cancelStateOf(const IntrusivePtr<SharedPromise> &sharedPromise) {
+    IntrusivePtr<PromiseHolder> promiseHolder = sharedPromise->obtainLock();
+#if PROMISE_MULTITHREAD
+    std::lock_guard<Mutex> lock(promiseHolder->mutex_, std::adopt_lock_t());
+#endif
+    if (!promiseHolder->cancel_) {
+        promiseHolder->cancel_ = makeIntrusive<CancelState>();
+        promiseHolder->cancel_->promiseHolder_ = promiseHolder;
+    }
+    return promiseHolder->cancel_;
+}
+
+// The inputs of the combinators are kept by weak references to their
+// holders, to be cancelled. The handlers of an input keep the combinator,
+// so a strong reference would keep an abandoned input alive with it.
+typedef std::vector<IntrusiveWeakPtr<PromiseHolder>> WeakPromises;
+
+// The root holder is kept, it is the one kept by the defer which settles it
+static inline IntrusiveWeakPtr<PromiseHolder> weakPromiseOf(const Promise &promise) {
+    IntrusivePtr<PromiseHolder> promiseHolder = promise.sharedPromise_->obtainLock();
+#if PROMISE_MULTITHREAD
+    promiseHolder->mutex_.unlock();
+#endif
+    return IntrusiveWeakPtr<PromiseHolder>(promiseHolder);
+}
+
+// The promise of the holder if it is alive, or an empty one
+static inline Promise promiseOf(const IntrusiveWeakPtr<PromiseHolder> &weakPromise) {
+    Promise promise;
+    IntrusivePtr<PromiseHolder> promiseHolder = weakPromise.lock();
+    if (promiseHolder)
+        promise.sharedPromise_ = makeIntrusive<SharedPromise>(promiseHolder);
+    return promise;
+}
+
+void Defer::onCancel(std::function<void()> &&func) const {
+    if (task_->state_ != TaskState::kPending) return;
+    cancelStateOf(sharedPromise_)->add(std::move(func));
+}
+
+CancellationToken Defer::getToken() const {
+    return CancellationToken(cancelStateOf(sharedPromise_));
+}
+
+// Reject the holder by cancelled_error. If the holder has another state,
+// a promise was joined to it, and that state stops the work of the promise.
+// A holder running a handler or hopping to an executor is settled already,
+// the step in progress is let to finish then.
+void CancelState::rejectHolder(const IntrusivePtr<PromiseHolder> &promiseHolder) {
+    IntrusivePtr<CancelState> joined;
+    {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<Mutex> lock(promiseHolder->mutex_);
+#endif
+        joined = promiseHolder->cancel_;
+    }
+    if (joined && joined.get() != this)
+        joined->cancel();
+
+    IntrusivePtr<Task> task;
+    {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<Mutex> lock(promiseHolder->mutex_);
+#endif
+        if (promiseHolder->state_ != TaskState::kPending || promiseHolder->busy_) return;
+        takeInbox(*promiseHolder);
+        if (promiseHolder->pendingTasks_.size() == 0) return;
+        task = promiseHolder->pendingTasks_.front();
+    }
+
+    Defer defer(task);
+    defer.reject(std::make_exception_ptr(cancelled_error()));
+}
+
+CancelState::CancelState()
+    : cancelled_(false)
+    , nextId_(0)
+#if PROMISE_STOP_TOKEN
+    , stopSource_(std::nostopstate)
+#endif
+{
+}
+
+void CancelState::dispose() {
+    for (auto &link : links_)
+        link.first->remove(link.second);
+    links_.clear();
+    callbacks_.clear();
+    promiseHolder_.reset();
+#if PROMISE_STOP_TOKEN
+    stopCallback_.reset();
+#endif
+}
+
+size_t CancelState::add(std::function<void()> &&func) {
+    {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(mutex_);
+#endif
+        if (!cancelled_) {
+            callbacks_.push_back(std::make_pair(++nextId_, std::move(func)));
+            return nextId_;
+        }
+    }
+    func();
+    return 0;
+}
+
+void CancelState::remove(size_t id) {
+    Callbacks removed; // released after unlocked
+    {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(mutex_);
+#endif
+        callbacks_.remove_if([&removed, id](std::pair<size_t, std::function<void()>> &callback) {
+            if (callback.first != id) return false;
+            removed.push_back(std::move(callback));
+            return true;
+        });
+    }
+}
+
+void CancelState::link(const IntrusivePtr<CancelState> &parent) {
+    IntrusiveWeakPtr<CancelState> child(IntrusivePtr<CancelState>(this));
+    size_t id = parent->add([child]() {
+        IntrusivePtr<CancelState> state = child.lock();
+        if (state) state->cancel();
+    });
+    if (id != 0) {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(mutex_);
+#endif
+        links_.push_back(std::make_pair(parent, id));
+    }
+}
+
+void CancelState::cancel() {
+    Callbacks callbacks;
+    IntrusivePtr<PromiseHolder> promiseHolder;
+#if PROMISE_STOP_TOKEN
+    std::stop_source stopSource(std::nostopstate);
+#endif
+    {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(mutex_);
+#endif
+        if (cancelled_) return;
+        cancelled_ = true;
+        callbacks.splice(callbacks_);
+        promiseHolder = promiseHolder_.lock();
+#if PROMISE_STOP_TOKEN
+        stopSource = stopSource_;
+#endif
+    }
+
+    // Reject first, so that the promise is rejected by cancelled_error,
+    // even if a callback settles it in another way.
+    if (promiseHolder)
+        rejectHolder(promiseHolder);
+#if PROMISE_STOP_TOKEN
+    if (stopSource.stop_possible())
+        stopSource.request_stop();
+#endif
+    for (auto &callback : callbacks)
+        callback.second();
+}
+
+void CancelState::settle(Callbacks &dropped) {
+#if PROMISE_MULTITHREAD
+    std::lock_guard<std::mutex> lock(mutex_);
+#endif
+    dropped.splice(callbacks_);
+}
+
+bool CancellationToken::isCancelled() const {
+    return state_ && state_->cancelled_;
+}
+
+size_t CancellationToken::onCancel(std::function<void()> &&func) const {
+    if (!state_) return 0;
+    return state_->add(std::move(func));
+}
+
+void CancellationToken::removeOnCancel(size_t id) const {
+    if (state_ && id != 0)
+        state_->remove(id);
+}
+
+#if PROMISE_STOP_TOKEN
+CancellationToken::CancellationToken(const std::stop_token &stopToken) {
+    if (!stopToken.stop_possible()) return;
+    state_ = makeIntrusive<CancelState>();
+
+    IntrusiveWeakPtr<CancelState> weakState(state_);
+    auto onStop = [weakState]() {
+        IntrusivePtr<CancelState> state = weakState.lock();
+        if (state) state->cancel();
+    };
+    state_->stopCallback_ = std::make_shared<std::stop_callback<decltype(onStop)>>(stopToken, std::move(onStop));
+}
+
+std::stop_token CancellationToken::getStopToken() const {
+    if (!state_) return std::stop_token();
+
+    std::stop_source stopSource(std::nostopstate);
+    bool cancelled = false;
+    {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(state_->mutex_);
+#endif
+        if (!state_->stopSource_.stop_possible())
+            state_->stopSource_ = std::stop_source();
+        stopSource = state_->stopSource_;
+        cancelled = state_->cancelled_;
+    }
+    if (cancelled)
+        stopSource.request_stop();
+    return stopSource.get_token();
+}
+#endif
+
+CancellationSource::CancellationSource()
+    : state_(makeIntrusive<CancelState>()) {
+}
+
+CancellationSource::CancellationSource(const CancellationToken &parent)
+    : state_(makeIntrusive<CancelState>()) {
+    if (parent.state_)
+        state_->link(parent.state_);
+}
+
+CancellationToken CancellationSource::getToken() const {
+    return CancellationToken(state_);
+}
+
+void CancellationSource::cancel() const {
+    state_->cancel();
+}
+
+bool CancellationSource::isCancelled() const {
+    return state_->cancelled_;
+}
+
+
+static inline size_t loopWord(size_t iteration, LoopState::Phase phase) {
+    return (iteration << 2) | phase;
+}
+
+void LoopState::run() {
+    size_t word = word_.load();
+    for (;;) {
+        size_t iteration = (word >> 2);
+        // The promise of loop is cancelled
+        if (defer_.task_->state_ != TaskState::kPending) {
+            finish(iteration);
+            return;
+        }
+
+        DeferLoop loop(IntrusivePtr<LoopState>(this), iteration);
+        try {
+            run_(loop);
+        }
+        catch (...) {
+            if (finish(iteration))
+                defer_.reject(std::current_exception());
+        }
+
+        word = loopWord(iteration, kRunning);
+        if (word_.compare_exchange_strong(word, loopWord(iteration, kWaiting)))
+            return;
+        if ((word & 3) == kDone)
+            return;
+        word = loopWord(iteration + 1, kRunning);
+        word_.store(word);
+    }
+}
+
+void LoopState::doContinue(size_t iteration) {
+    size_t word = word_.load();
+    while ((word >> 2) == iteration) {
+        if ((word & 3) == kRunning) {
+            if (word_.compare_exchange_weak(word, loopWord(iteration, kContinued)))
+                return;
+        }
+        else if ((word & 3) == kWaiting) {
+            if (word_.compare_exchange_weak(word, loopWord(iteration + 1, kRunning))) {
+                run();
+                return;
+            }
+        }
+        else {
+            return;
+        }
+    }
+}
+
+bool LoopState::finish(size_t iteration) {
+    size_t word = word_.load();
+    while ((word >> 2) == iteration
+        && ((word & 3) == kRunning || (word & 3) == kWaiting)) {
+        if (word_.compare_exchange_weak(word, loopWord(iteration, kDone)))
+            return true;
+    }
+    return false;
+}
+
+DeferLoop::DeferLoop(const IntrusivePtr<LoopState> &state, size_t iteration)
+    : state_(state)
+    , iteration_(iteration) {
+}
+
+void DeferLoop::doContinue() const {
+    state_->doContinue(iteration_);
+}
+
+void DeferLoop::doBreak(const any &arg) const {
+    if (state_->finish(iteration_))
+        state_->defer_.resolve(arg);
+}
+
+void DeferLoop::doBreak(any &&arg) const {
+    if (state_->finish(iteration_))
+        state_->defer_.resolve(std::move(arg));
+}
+
+void DeferLoop::reject(any &&arg) const {
+    if (state_->finish(iteration_))
+        state_->defer_.reject(std::move(arg));
+}
+
+void DeferLoop::reject(const any &arg) const {
+    if (state_->finish(iteration_))
+        state_->defer_.reject(arg);
+}
+
+Promise DeferLoop::getPromise() const {
+    return state_->defer_.getPromise();
+}
+
+#if PROMISE_POOL
+struct Pool {
+    static const size_t kGranularity = 16;
+    static const size_t kClasses     = 16;          // block size up to 256 bytes
+    static const size_t kSlabSize    = 16 * 1024;
+    static const size_t kBatch       = 64;          // blocks moved between cache and depot at once
+    static const size_t kCacheLimit  = 2 * kBatch;  // blocks kept by one thread for each class
+
+    struct Block {
+        Block *next_;
+    };
+
+    // Shared by all threads, keeps the slabs and the blocks returned from thread caches
+    struct Depot {
+#if PROMISE_MULTITHREAD
+        std::mutex mutex_;
+#endif
+        Block *blocks_[kClasses];
+        Block *slabs_;
+        std::atomic<size_t> slabCount_;
+    };
+
+    struct Cache {
+        Cache() {
+            for (size_t i = 0; i < kClasses; ++i) {
+                blocks_[i] = nullptr;
+                counts_[i] = 0;
+            }
+            hits_ = 0;
+            misses_ = 0;
+        }
+        ~Cache() {
+            for (size_t i = 0; i < kClasses; ++i)
+                giveBack(i, blocks_[i], counts_[i]);
+            isCacheDestroyed() = true;
+        }
+        Block *blocks_[kClasses];
+        size_t counts_[kClasses];
+        size_t hits_;
+        size_t misses_;
+    };
+
+    // Never destroyed, so blocks can be freed by static and thread_local destructors
+    static Depot &depot() {
+        static Depot *depot = []() {
+            Depot *depot = new Depot;
+            for (size_t i = 0; i < kClasses; ++i)
+                depot->blocks_[i] = nullptr;
+            depot->slabs_ = nullptr;
+            depot->slabCount_ = 0;
+            return depot;
+        }();
+        return *depot;
+    }
+
+    static bool &isCacheDestroyed() {
+        static thread_local bool destroyed = false;
+        return destroyed;
+    }
+
+    // Returns null if the thread is exiting
+    static Cache *cache() {
+        if (isCacheDestroyed()) return nullptr;
+        static thread_local Cache cache;
+        return &cache;
+    }
+
+    static inline size_t blockSize(size_t index) {
+        return (index + 1) * kGranularity;
+    }
+
+    // Put a list of blocks to depot
+    static void giveBack(size_t index, Block *first, size_t count) {
+        if (count == 0) return;
+        Block *last = first;
+        for (size_t i = 1; i < count; ++i)
+            last = last->next_;
+
+        Depot &depot = Pool::depot();
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(depot.mutex_);
+#endif
+        last->next_ = depot.blocks_[index];
+        depot.blocks_[index] = first;
+    }
+
+    // Take at most "count" blocks from depot, carve a new slab if it is empty
+    static Block *take(size_t index, size_t &count) {
+        Depot &depot = Pool::depot();
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(depot.mutex_);
+#endif
+        if (depot.blocks_[index] == nullptr) {
+            // The first block of a slab links all slabs
+            Block *slab = static_cast<Block *>(::operator new(kSlabSize));
+            slab->next_ = depot.slabs_;
+            depot.slabs_ = slab;
+            ++depot.slabCount_;
+
+            size_t size = blockSize(index);
+            char *begin = reinterpret_cast<char *>(slab) + kGranularity;
+            for (size_t i = (kSlabSize - kGranularity) / size; i-- > 0; ) {
+                Block *block = reinterpret_cast<Block *>(begin + i * size);
+                block->next_ = depot.blocks_[index];
+                depot.blocks_[index] = block;
+            }
+        }
+
+        Block *first = depot.blocks_[index];
+        Block *last = first;
+        size_t taken = 1;
+        while (taken < count && last->next_ != nullptr) {
+            last = last->next_;
+            ++taken;
         }
+        depot.blocks_[index] = last->next_;
+        last->next_ = nullptr;
+        count = taken;
+        return first;
     }
-}
+};
 
-Defer::Defer(const std::shared_ptr<Task> &task) {
-    std::shared_ptr<SharedPromise> sharedPromise(new SharedPromise{ task->promiseHolder_.lock() });
-#if PROMISE_MULTITHREAD
-    std::shared_ptr<Mutex> mutex = sharedPromise->obtainLock();
-    std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
-#endif
+void *poolAllocate(size_t size) {
+    size_t index = (size + Pool::kGranularity - 1) / Pool::kGranularity - 1;
+    if (index >= Pool::kClasses)
+        return ::operator new(size);
 
-    task_ = task;
-    sharedPromise_ = sharedPromise;
+    Pool::Cache *cache = Pool::cache();
+    if (cache == nullptr) {
+        size_t count = 1;
+        return Pool::take(index, count);
+    }
+
+    Pool::Block *block = cache->blocks_[index];
+    if (block != nullptr) {
+        ++cache->hits_;
+    }
+    else {
+        ++cache->misses_;
+        size_t count = Pool::kBatch;
+        block = Pool::take(index, count);
+        cache->counts_[index] = count;
+    }
+    cache->blocks_[index] = block->next_;
+    --cache->counts_[index];
+    return block;
 }
 
+void poolFree(void *ptr, size_t size) {
+    size_t index = (size + Pool::kGranularity - 1) / Pool::kGranularity - 1;
+    if (index >= Pool::kClasses) {
+        ::operator delete(ptr);
+        return;
+    }
 
-void Defer::resolve(const any &arg) const {
-#if PROMISE_MULTITHREAD
-    std::shared_ptr<Mutex> mutex = this->sharedPromise_->obtainLock();
-    std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
+    Pool::Block *block = static_cast<Pool::Block *>(ptr);
+    Pool::Cache *cache = Pool::cache();
+    if (cache == nullptr) {
+        Pool::giveBack(index, block, 1);
+        return;
+    }
+
+    block->next_ = cache->blocks_[index];
+    cache->blocks_[index] = block;
+    if (++cache->counts_[index] > Pool::kCacheLimit) {
+        // Keep the most recently freed blocks, and give back the others
+        Pool::Block *last = block;
+        for (size_t i = 1; i < Pool::kCacheLimit - Pool::kBatch; ++i)
+            last = last->next_;
+        Pool::giveBack(index, last->next_, cache->counts_[index] - (Pool::kCacheLimit - Pool::kBatch));
+        last->next_ = nullptr;
+        cache->counts_[index] = Pool::kCacheLimit - Pool::kBatch;
+    }
+}
 #endif
 
-    if (task_->state_ != TaskState::kPending) return;
-    std::shared_ptr<PromiseHolder> &promiseHolder = sharedPromise_->promiseHolder_;
-    promiseHolder->state_ = TaskState::kResolved;
-    promiseHolder->value_ = arg;
-    call(task_);
+PoolStatistics getPoolStatistics() {
+    PoolStatistics statistics = { 0, 0, 0 };
+#if PROMISE_POOL
+    Pool::Cache *cache = Pool::cache();
+    if (cache != nullptr) {
+        statistics.hits_ = cache->hits_;
+        statistics.misses_ = cache->misses_;
+    }
+    statistics.slabs_ = Pool::depot().slabCount_;
+#endif
+    return statistics;
 }
 
-void Defer::reject(const any &arg) const {
 #if PROMISE_MULTITHREAD
-    std::shared_ptr<Mutex> mutex = this->sharedPromise_->obtainLock();
-    std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
-#endif
+/*
+ * Wait queues of the Mutex, like a parking lot. A lock is hashed to one
+ * bucket by its address, and the threads parked on different locks of one
+ * bucket wake up each other and retry. Never destroyed, so promises can be
+ * unlocked by static and thread_local destructors.
+ */
+struct ParkingLot {
+    struct Bucket {
+        std::mutex              mutex_;
+        std::condition_variable cond_;
+    };
 
-    if (task_->state_ != TaskState::kPending) return;
-    std::shared_ptr<PromiseHolder> &promiseHolder = sharedPromise_->promiseHolder_;
-    promiseHolder->state_ = TaskState::kRejected;
-    promiseHolder->value_ = arg;
-    call(task_);
-}
+    ParkingLot() {
+        size_t cores = std::thread::hardware_concurrency();
+        size_t size = 16;
+        while (size < cores * 4)
+            size *= 2;
+        buckets_ = new Bucket[size];
+        mask_ = size - 1;
+    }
 
+    static ParkingLot &instance() {
+        static ParkingLot *parkingLot = new ParkingLot;
+        return *parkingLot;
+    }
 
-Promise Defer::getPromise() const {
-    return Promise{ sharedPromise_ };
-}
+    inline Bucket &bucketOf(const void *address) {
+        uintptr_t hash = reinterpret_cast<uintptr_t>(address) >> 4;
+        hash ^= (hash >> 8) ^ (hash >> 16);
+        return buckets_[hash & mask_];
+    }
 
+    Bucket *buckets_;
+    size_t  mask_;
+};
 
-struct DoBreakTag {};
+// Id of the calling thread in the lock word, indexes start from 1
+struct LockOwner {
+    static uint32_t self() {
+        static std::atomic<uint32_t> next(1);
+        static thread_local uint32_t id = next.fetch_add(1, std::memory_order_relaxed);
+        return id << 3;
+    }
+};
 
-DeferLoop::DeferLoop(const Defer &defer)
-    : defer_(defer) {
+Mutex::Mutex()
+    : word_(0)
+    , depth_(0) {
 }
 
-void DeferLoop::doContinue() const {
-    defer_.resolve();
+Mutex::Mutex(bool biased)
+    : word_(biased ? (LockOwner::self() | kBiased) : 0)
+    , depth_(0) {
 }
 
-void DeferLoop::doBreak(const any &arg) const {
-    defer_.reject(DoBreakTag(), arg);
-}
+/*
+ * The bias owner sets depth_ then reads word_, and the revoker sets kRevoke
+ * to word_ then reads depth_, both in sequential consistent order, so at
+ * least one of them sees the other. The owner backs off to lockSlow() if
+ * revoked, and the revoker waits until the owner leaves the biased section.
+ */
+void Mutex::lock() {
+    uint32_t self = LockOwner::self();
+    uint32_t word = word_.load(std::memory_order_relaxed);
+    uint32_t depth = depth_.load(std::memory_order_relaxed);
+    if ((word & ~kParked) == self
+        || (depth != 0 && (word & ~kRevoke) == (self | kBiased))) {
+        depth_.store(depth + 1, std::memory_order_relaxed);
+        return;
+    }
 
-void DeferLoop::reject(const any &arg) const {
-    defer_.reject(arg);
+    if (word == (self | kBiased)) {
+        depth_.store(kBiasedSection | 1, std::memory_order_seq_cst);
+        if (word_.load(std::memory_order_seq_cst) == word)
+            return;
+        depth_.store(0, std::memory_order_release);
+    }
+    lockSlow(self);
 }
 
-Promise DeferLoop::getPromise() const {
-    return defer_.getPromise();
+void Mutex::unlock() {
+    uint32_t depth = depth_.load(std::memory_order_relaxed);
+    if (depth == (kBiasedSection | 1)) {
+        depth_.store(0, std::memory_order_release);
+        return;
+    }
+    if ((depth & ~kBiasedSection) > 1) {
+        depth_.store(depth - 1, std::memory_order_relaxed);
+        return;
+    }
+    depth_.store(0, std::memory_order_relaxed);
+    if (word_.exchange(0, std::memory_order_release) & kParked)
+        unpark();
 }
 
-#if PROMISE_MULTITHREAD
-Mutex::Mutex()
-    : cond_()
-    , mutex_()
-    , lock_count_(0) {
+void Mutex::lockSlow(uint32_t self) {
+    static const int kSpins = 32;
+    int spins = 0;
+    uint32_t word = word_.load(std::memory_order_relaxed);
+    while (true) {
+        if (word == 0) {
+            if (word_.compare_exchange_weak(word, self, std::memory_order_acquire, std::memory_order_relaxed))
+                break;
+        }
+        else if (word & kBiased) {
+            // Revoke the bias, and take the lock after the owner leaves the biased section
+            if (!word_.compare_exchange_weak(word, word | kRevoke, std::memory_order_seq_cst, std::memory_order_relaxed))
+                continue;
+            word |= kRevoke;
+            while (depth_.load(std::memory_order_seq_cst) != 0)
+                std::this_thread::yield();
+            if (word_.compare_exchange_strong(word, self, std::memory_order_acquire, std::memory_order_relaxed))
+                break;
+        }
+        else if (spins < kSpins) {
+            ++spins;
+            word = word_.load(std::memory_order_relaxed);
+        }
+        else {
+            park(word);
+            word = word_.load(std::memory_order_relaxed);
+        }
+    }
+    depth_.store(1, std::memory_order_relaxed);
 }
 
-void Mutex::lock() {
-    mutex_.lock();
-    ++lock_count_;
+// Sleep until the lock is released, unless it is released already
+void Mutex::park(uint32_t word) {
+    ParkingLot::Bucket &bucket = ParkingLot::instance().bucketOf(this);
+    std::unique_lock<std::mutex> lock(bucket.mutex_);
+    while ((word & kParked) == 0) {
+        if (word == 0 || (word & kBiased) != 0) return;
+        if (word_.compare_exchange_weak(word, word | kParked, std::memory_order_relaxed))
+            break;
+    }
+    bucket.cond_.wait(lock);
 }
 
-void Mutex::unlock() {
-    --lock_count_;
-    mutex_.unlock();
+// Called after the lock is released, this may be destroyed already
+void Mutex::unpark() {
+    ParkingLot::Bucket &bucket = ParkingLot::instance().bucketOf(this);
+    {
+        // The parked thread is waiting, once its bucket lock can be taken
+        std::lock_guard<std::mutex> lock(bucket.mutex_);
+    }
+    bucket.cond_.notify_all();
 }
 
+// The levels after the first one are counted only, in O(1)
 void Mutex::lock(size_t lock_count) {
-    for (size_t i = 0; i < lock_count; ++i)
-        this->lock();
+    if (lock_count == 0) return;
+    this->lock();
+    uint32_t depth = depth_.load(std::memory_order_relaxed);
+    depth_.store(depth + (uint32_t)(lock_count - 1), std::memory_order_relaxed);
 }
 
+// Release all levels with one atomic operation, as unlock_guard_t does
 void Mutex::unlock(size_t lock_count) {
-    for (size_t i = 0; i < lock_count; ++i)
-        this->unlock();
+    if (lock_count == 0) return;
+    uint32_t depth = depth_.load(std::memory_order_relaxed);
+    if ((depth & ~kBiasedSection) > lock_count) {
+        depth_.store(depth - (uint32_t)lock_count, std::memory_order_relaxed);
+        return;
+    }
+    depth_.store((depth & kBiasedSection) | 1, std::memory_order_relaxed);
+    this->unlock();
 }
 #endif
 
 PromiseHolder::PromiseHolder() 
-    : owners_()
-    , pendingTasks_()
+    : pendingTasks_()
     , state_(TaskState::kPending)
+    , busy_(false)
+    , rank_(0)
     , value_()
 #if PROMISE_MULTITHREAD
-    , mutex_(std::make_shared<Mutex>())
+    , mutex_(ThreadAffinity::enabled())
+    , inbox_(nullptr)
 #endif
 {
 }
 
-PromiseHolder::~PromiseHolder() {
+void PromiseHolder::dispose() {
     if (this->state_ == TaskState::kRejected) {
         static thread_local std::atomic<bool> s_inUncaughtExceptionHandler{false};
-        if(s_inUncaughtExceptionHandler) return;
-        s_inUncaughtExceptionHandler = true;
-        struct Releaser {
-            Releaser(std::atomic<bool> *inUncaughtExceptionHandler)
-                : inUncaughtExceptionHandler_(inUncaughtExceptionHandler) {}
-            ~Releaser() {
-                *inUncaughtExceptionHandler_ = false;
-            }
-            std::atomic<bool> *inUncaughtExceptionHandler_;
-        } releaser(&s_inUncaughtExceptionHandler);
+        if(!s_inUncaughtExceptionHandler) {
+            s_inUncaughtExceptionHandler = true;
+            struct Releaser {
+                Releaser(std::atomic<bool> *inUncaughtExceptionHandler)
+                    : inUncaughtExceptionHandler_(inUncaughtExceptionHandler) {}
+                ~Releaser() {
+                    *inUncaughtExceptionHandler_ = false;
+                }
+                std::atomic<bool> *inUncaughtExceptionHandler_;
+            } releaser(&s_inUncaughtExceptionHandler);
 
-        PromiseHolder::onUncaughtException(this->value_);
+            PromiseHolder::onUncaughtException(this->value_);
+        }
     }
+
+    // Release the tasks and value now, the memory of this holder is kept
+    // until the last weak reference (from tasks) is gone.
+    takeInbox(*this, true);
+    this->pendingTasks_.clear();
+    this->value_.clear();
+    this->cancel_.reset();
+    this->forward_.reset();
 }
 
 
@@ -468,31 +1649,40 @@ void PromiseHolder::handleUncaughtException(const any &onUncaughtException) {
     (*getUncaughtExceptionHandler()) = onUncaughtException;
 }
 
-#if PROMISE_MULTITHREAD
-std::shared_ptr<Mutex> SharedPromise::obtainLock() const {
+IntrusivePtr<PromiseHolder> SharedPromise::obtainLock() {
+    IntrusivePtr<PromiseHolder> promiseHolder = this->getPromiseHolder();
+    bool forwarded = false;
     while (true) {
-        std::shared_ptr<Mutex> mutex = this->promiseHolder_->mutex_;
-        mutex->lock();
-
-        // pointer to mutex may be changed after locked, 
-        // in this case we should try to lock and test again
-        if (mutex == this->promiseHolder_->mutex_)
-            return mutex;
-        mutex->unlock();
+#if PROMISE_MULTITHREAD
+        promiseHolder->mutex_.lock();
+#endif
+        // join() forwards a holder with it locked, so the locked holder
+        // without forward_ is the root
+        IntrusivePtr<PromiseHolder> forward = promiseHolder->getForward();
+        if (!forward)
+            break;
+#if PROMISE_MULTITHREAD
+        promiseHolder->mutex_.unlock();
+#endif
+        promiseHolder = std::move(forward);
+        forwarded = true;
     }
-    return nullptr;
+
+    // Path compression, the holders passed may be released now
+    if (forwarded)
+        this->setPromiseHolder(promiseHolder);
+    return promiseHolder;
 }
-#endif
 
 Promise &Promise::then(const any &deferOrPromiseOrOnResolved) {
     if (deferOrPromiseOrOnResolved.type() == type_id<Defer>()) {
         Defer &defer = deferOrPromiseOrOnResolved.cast<Defer &>();
         Promise promise = defer.getPromise();
-        Promise &ret = then([defer](const any &arg) -> any {
-            defer.resolve(arg);
+        Promise &ret = then([defer](any arg) -> any {
+            defer.resolve(std::move(arg));
             return nullptr;
-        }, [defer](const any &arg) ->any {
-            defer.reject(arg);
+        }, [defer](any arg) ->any {
+            defer.reject(std::move(arg));
             return nullptr;
         });
 
@@ -503,111 +1693,164 @@ Promise &Promise::then(const any &deferOrPromiseOrOnResolved) {
         return ret;
     }
     else if (deferOrPromiseOrOnResolved.type() == type_id<DeferLoop>()) {
+        // A finished iteration ignores the loop, nothing to release here
         DeferLoop &loop = deferOrPromiseOrOnResolved.cast<DeferLoop &>();
-        Promise promise = loop.getPromise();
-
-        Promise &ret = then([loop](const any &arg) -> any {
+        return then([loop](const any &arg) -> any {
             (void)arg;
             loop.doContinue();
             return nullptr;
-        }, [loop](const any &arg) ->any {
-            loop.reject(arg);
+        }, [loop](any arg) ->any {
+            loop.reject(std::move(arg));
             return nullptr;
         });
-
-        promise.finally([=]() {
-            ret.reject();
-        });
-
-        return ret;
     }
     else if (deferOrPromiseOrOnResolved.type() == type_id<Promise>()) {
         Promise &promise = deferOrPromiseOrOnResolved.cast<Promise &>();
 
-        std::shared_ptr<Task> task;
+        IntrusivePtr<Task> task;
         {
+            IntrusivePtr<PromiseHolder> locked0 = this->sharedPromise_->obtainLock();
 #if PROMISE_MULTITHREAD
-            std::shared_ptr<Mutex> mutex0 = this->sharedPromise_->obtainLock();
-            std::lock_guard<Mutex> lock0(*mutex0, std::adopt_lock_t());
-            std::shared_ptr<Mutex> mutex1 = promise.sharedPromise_->obtainLock();
-            std::lock_guard<Mutex> lock1(*mutex1, std::adopt_lock_t());
+            std::lock_guard<Mutex> lock0(locked0->mutex_, std::adopt_lock_t());
+#endif
+            IntrusivePtr<PromiseHolder> locked1 = promise.sharedPromise_->obtainLock();
+#if PROMISE_MULTITHREAD
+            std::lock_guard<Mutex> lock1(locked1->mutex_, std::adopt_lock_t());
 #endif
 
-            if (promise.sharedPromise_ && promise.sharedPromise_->promiseHolder_) {
-                join(this->sharedPromise_->promiseHolder_, promise.sharedPromise_->promiseHolder_);
-                if (this->sharedPromise_->promiseHolder_->pendingTasks_.size() > 0) {
-                    task = this->sharedPromise_->promiseHolder_->pendingTasks_.front();
+            // Nothing to join if the two promises are already joined
+            if (locked0 != locked1) {
+                IntrusivePtr<PromiseHolder> root = join(locked0, locked1);
+                if (root->pendingTasks_.size() > 0) {
+                    task = root->pendingTasks_.front();
                 }
             }
         }
         if(task)
-            call(task);
+            dispatch(task);
         return *this;
     }
     else {
-        return then(deferOrPromiseOrOnResolved, any());
+        return then(any(deferOrPromiseOrOnResolved), any());
+    }
+}
+
+Promise &Promise::then(any &&deferOrPromiseOrOnResolved) {
+    if (deferOrPromiseOrOnResolved.type() == type_id<Defer>()
+        || deferOrPromiseOrOnResolved.type() == type_id<DeferLoop>()
+        || deferOrPromiseOrOnResolved.type() == type_id<Promise>()) {
+        const any &chain = deferOrPromiseOrOnResolved;
+        return then(chain);
     }
+    return then(std::move(deferOrPromiseOrOnResolved), any());
 }
 
 Promise &Promise::then(const any &onResolved, const any &onRejected) {
-    std::shared_ptr<Task> task;
+    return then(any(onResolved), any(onRejected));
+}
+
+Promise &Promise::then(any &&onResolved, any &&onRejected) {
+    IntrusivePtr<PromiseHolder> promiseHolder = this->sharedPromise_->getPromiseHolder();
+    IntrusivePtr<Task> task = makeIntrusive<Task>(
+        TaskState::kPending,
+        promiseHolder,
+        std::move(onResolved),
+        std::move(onRejected));
+
+#if PROMISE_MULTITHREAD
+    // Lock free, unless the holder was joined to another one
+    if (!pushInbox(*promiseHolder, task.get()))
+#endif
     {
+        IntrusivePtr<PromiseHolder> locked = this->sharedPromise_->obtainLock();
 #if PROMISE_MULTITHREAD
-        std::shared_ptr<Mutex> mutex = this->sharedPromise_->obtainLock();
-        std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
+        std::lock_guard<Mutex> lock(locked->mutex_, std::adopt_lock_t());
 #endif
-
-        task = std::make_shared<Task>(Task {
-            TaskState::kPending,
-            sharedPromise_->promiseHolder_,
-            onResolved,
-            onRejected
-        });
-        sharedPromise_->promiseHolder_->pendingTasks_.push_back(task);
+        if (locked != promiseHolder)
+            task->setPromiseHolder(locked);
+        takeInbox(*locked); // added before this one
+        locked->pendingTasks_.push_back(task);
     }
-    call(task);
+    dispatch(task);
     return *this;
 }
 
 Promise &Promise::fail(const any &onRejected) {
-    return then(any(), onRejected);
+    return then(any(), any(onRejected));
+}
+
+Promise &Promise::fail(any &&onRejected) {
+    return then(any(), std::move(onRejected));
 }
 
 Promise &Promise::always(const any &onAlways) {
-    return then(onAlways, onAlways);
+    return then(any(onAlways), any(onAlways));
 }
 
 Promise &Promise::finally(const any &onFinally) {
-    return then([onFinally](const any &arg)->any {
-        return newPromise([onFinally, arg](Defer &defer) {
-            try {
-                onFinally.call(arg);
-            }
-            catch (bad_any_cast &) {}
-            defer.resolve(arg);
-        });
-    }, [onFinally](const any &arg)->any {
-        return newPromise([onFinally, arg](Defer &defer) {
-            try {
-                onFinally.call(arg);
-            }
-            catch (bad_any_cast &) {}
-            defer.reject(arg);
-        });
+    // The value is moved through, so move-only values are passed as well
+    return then([onFinally](any arg)->any {
+        try {
+            onFinally.call(arg);
+        }
+        catch (bad_any_cast &) {}
+        Promise promise = newPromise();
+        promise.resolve(std::move(arg));
+        return promise;
+    }, [onFinally](any arg)->any {
+        try {
+            onFinally.call(arg);
+        }
+        catch (bad_any_cast &) {}
+        Promise promise = newPromise();
+        promise.reject(std::move(arg));
+        return promise;
     });
 }
 
+Promise &Promise::then(const Executor &executor, any &&onResolved, any &&onRejected) {
+    if (executor.isInline())
+        return then(std::move(onResolved), std::move(onRejected));
+    return then(onExecutor(executor, std::move(onResolved)),
+                onExecutor(executor, std::move(onRejected)));
+}
+
+Promise &Promise::via(const Executor &executor) {
+    if (executor.isInline())
+        return *this;
+    // Empty handlers just pass the value through, after the hop
+    ExecutorHandler onResolved = { executor, any() };
+    ExecutorHandler onRejected = { executor, any() };
+    return then(any(std::move(onResolved)), any(std::move(onRejected)));
+}
+
+// Lock free check for the promise settled already, which is not calling its
+// tasks either. A holder joined to another one looks resolved, so it is not.
+static inline bool isSettled(const SharedPromise &sharedPromise) {
+    IntrusivePtr<PromiseHolder> promiseHolder = sharedPromise.getPromiseHolder();
+    return promiseHolder->state_ != TaskState::kPending && !promiseHolder->getForward();
+}
 
 void Promise::resolve(const any &arg) const {
+    resolve(any(arg));
+}
+
+void Promise::reject(const any &arg) const {
+    reject(any(arg));
+}
+
+void Promise::resolve(any &&arg) const {
     if (!this->sharedPromise_) return;
-    std::shared_ptr<Task> task;
+    if (isSettled(*this->sharedPromise_)) return;
+    IntrusivePtr<Task> task;
     {
+        IntrusivePtr<PromiseHolder> locked = this->sharedPromise_->obtainLock();
 #if PROMISE_MULTITHREAD
-        std::shared_ptr<Mutex> mutex = this->sharedPromise_->obtainLock();
-        std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
+        std::lock_guard<Mutex> lock(locked->mutex_, std::adopt_lock_t());
 #endif
 
-        std::list<std::shared_ptr<Task>> &pendingTasks_ = this->sharedPromise_->promiseHolder_->pendingTasks_;
+        takeInbox(*locked);
+        PromiseHolder::TaskList &pendingTasks_ = locked->pendingTasks_;
         if (pendingTasks_.size() > 0) {
             task = pendingTasks_.front();
         }
@@ -615,20 +1858,22 @@ void Promise::resolve(const any &arg) const {
 
     if (task) {
         Defer defer(task);
-        defer.resolve(arg);
+        defer.resolve(std::move(arg));
     }
 }
 
-void Promise::reject(const any &arg) const {
+void Promise::reject(any &&arg) const {
     if (!this->sharedPromise_) return;
-    std::shared_ptr<Task> task;
+    if (isSettled(*this->sharedPromise_)) return;
+    IntrusivePtr<Task> task;
     {
+        IntrusivePtr<PromiseHolder> locked = this->sharedPromise_->obtainLock();
 #if PROMISE_MULTITHREAD
-        std::shared_ptr<Mutex> mutex = this->sharedPromise_->obtainLock();
-        std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
+        std::lock_guard<Mutex> lock(locked->mutex_, std::adopt_lock_t());
 #endif
 
-        std::list<std::shared_ptr<Task>> &pendingTasks_ = this->sharedPromise_->promiseHolder_->pendingTasks_;
+        takeInbox(*locked);
+        PromiseHolder::TaskList &pendingTasks_ = locked->pendingTasks_;
         if (pendingTasks_.size() > 0) {
             task = pendingTasks_.front();
         }
@@ -636,10 +1881,15 @@ void Promise::reject(const any &arg) const {
 
     if (task) {
         Defer defer(task);
-        defer.reject(arg);
+        defer.reject(std::move(arg));
     }
 }
 
+void Promise::cancel() const {
+    if (!this->sharedPromise_) return;
+    cancelStateOf(this->sharedPromise_)->cancel();
+}
+
 void Promise::clear() {
     sharedPromise_.reset();
 }
@@ -649,14 +1899,8 @@ Promise::operator bool() const {
 }
 
 Promise newPromise(const std::function<void(Defer &defer)> &run) {
-    Promise promise;
-    promise.sharedPromise_ = std::make_shared<SharedPromise>();
-    promise.sharedPromise_->promiseHolder_ = std::make_shared<PromiseHolder>();
-    promise.sharedPromise_->promiseHolder_->owners_.push_back(promise.sharedPromise_);
-    
-    // return as is
-    promise.then(any(), any());
-    std::shared_ptr<Task> &task = promise.sharedPromise_->promiseHolder_->pendingTasks_.front();
+    Promise promise = newPromise();
+    IntrusivePtr<Task> &task = promise.sharedPromise_->promiseHolder_->pendingTasks_.front();
 
     Defer defer(task);
     try {
@@ -669,45 +1913,50 @@ Promise newPromise(const std::function<void(Defer &defer)> &run) {
     return promise;
 }
 
+Promise newPromise(const std::function<void(Defer &defer)> &run, const CancellationToken &token) {
+    if (!token.state_)
+        return newPromise(run);
+
+    Promise promise = newPromise();
+    IntrusivePtr<PromiseHolder> &promiseHolder = promise.sharedPromise_->promiseHolder_;
+    Defer defer(promiseHolder->pendingTasks_.front());
+
+    IntrusivePtr<CancelState> state = makeIntrusive<CancelState>();
+    state->promiseHolder_ = promiseHolder;
+    promiseHolder->cancel_ = state;
+    // The work is not started if the token was cancelled already
+    state->link(token.state_);
+    if (state->cancelled_)
+        return promise;
+
+    try {
+        run(defer);
+    }
+    catch (...) {
+        defer.reject(std::current_exception());
+    }
+
+    return promise;
+}
+
 Promise newPromise() {
     Promise promise;
-    promise.sharedPromise_ = std::make_shared<SharedPromise>();
-    promise.sharedPromise_->promiseHolder_ = std::make_shared<PromiseHolder>();
-    promise.sharedPromise_->promiseHolder_->owners_.push_back(promise.sharedPromise_);
+    promise.sharedPromise_ = makeIntrusive<SharedPromise>();
+    IntrusivePtr<PromiseHolder> &promiseHolder = promise.sharedPromise_->promiseHolder_;
+    promiseHolder = makeIntrusive<PromiseHolder>();
 
-    // return as is
-    promise.then(any(), any());
+    // return as is, the holder is not shared yet so it is not locked
+    promiseHolder->pendingTasks_.push_back(
+        makeIntrusive<Task>(TaskState::kPending, promiseHolder, any(), any()));
     return promise;
 }
 
 Promise doWhile(const std::function<void(DeferLoop &loop)> &run) {
-
-    return newPromise([run](Defer &defer) {
-        DeferLoop loop(defer);
-        run(loop);
-    }).then([run](const any &arg) -> any {
-        (void)arg;
-        return doWhile(run);
-    }, [](const any &arg) -> any {
-        return newPromise([arg](Defer &defer) {
-            //printf("arg. type = %s\n", arg.type().name());
-
-            bool isBreak = false;
-            if (arg.type() == type_id<std::vector<any>>()) {
-                std::vector<any> &args = any_cast<std::vector<any> &>(arg);
-                if (args.size() == 2
-                    && args.front().type() == type_id<DoBreakTag>()
-                    && args.back().type() == type_id<std::vector<any>>()) {
-                    isBreak = true;
-                    defer.resolve(args.back());
-                }
-            }
-            
-            if(!isBreak) {
-                defer.reject(arg);
-            }
-        });
-    });
+    Promise promise = newPromise();
+    Defer defer(promise.sharedPromise_->promiseHolder_->pendingTasks_.front());
+    IntrusivePtr<LoopState> state = makeIntrusive<LoopState>(run, defer);
+    state->run();
+    return promise;
 }
 
 #if 0
@@ -720,48 +1969,271 @@ Promise resolve(const any &arg) {
 }
 #endif
 
-Promise all(const std::list<Promise> &promise_list) {
+// Shared by the handlers of all(), the last resolved one settles the promise
+struct AllState : public RefCounted<AllState> {
+    AllState(size_t size, const Defer &defer)
+        : remaining_(size)
+        , values_(size)
+        , defer_(defer) {
+    }
+
+    std::atomic<size_t>  remaining_;
+    std::vector<any>     values_;
+    Defer                defer_;
+};
+
+struct AllResolved {
+    void operator()(any &value) const {
+        state_->values_[index_] = std::move(value);
+        if (state_->remaining_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            state_->defer_.resolve(any(std::move(state_->values_)));
+    }
+    IntrusivePtr<AllState> state_;
+    size_t                 index_;
+};
+
+struct AllRejected {
+    void operator()(any &reason) const {
+        state_->defer_.reject(std::move(reason));
+    }
+    IntrusivePtr<AllState> state_;
+};
+
+static Promise all(std::vector<Promise> &&promise_list) {
     if (promise_list.size() == 0) {
         return resolve();
     }
 
-    std::shared_ptr<size_t> finished = std::make_shared<size_t>(0);
-    std::shared_ptr<size_t> size = std::make_shared<size_t>(promise_list.size());
-    std::shared_ptr<std::vector<any>> retArr = std::make_shared<std::vector<any>>();
-    retArr->resize(*size);
+    return newPromise([&promise_list](Defer &defer) {
+        IntrusivePtr<AllState> state = makeIntrusive<AllState>(promise_list.size(), defer);
+        WeakPromises promises;
+        promises.reserve(promise_list.size());
+        for (size_t index = 0; index < promise_list.size(); ++index) {
+            promise_list[index].then(AllResolved{ state, index }, AllRejected{ state });
+            promises.push_back(weakPromiseOf(promise_list[index]));
+        }
 
-    return newPromise([=](Defer &defer) {
-        size_t index = 0;
-        for (auto promise : promise_list) {
-            promise.then([=](const any &arg) {
-                (*retArr)[index] = arg;
-                if (++(*finished) >= *size) {
-                    defer.resolve(*retArr);
-                }
-            }, [=](const any &arg) {
-                defer.reject(arg);
-            });
+        // Not by the state, which keeps the defer of this promise
+        defer.onCancel([promises]() {
+            for (const IntrusiveWeakPtr<PromiseHolder> &promise : promises)
+                promiseOf(promise).cancel();
+        });
+    });
+}
+
+Promise all(const std::vector<Promise> &promise_list) {
+    return all(std::vector<Promise>(promise_list));
+}
+
+Promise all(const std::list<Promise> &promise_list) {
+    return all(std::vector<Promise>(promise_list.begin(), promise_list.end()));
+}
+
+// Shared by the handlers of allSettled()
+struct AllSettledState : public RefCounted<AllSettledState> {
+    AllSettledState(size_t size, const Defer &defer)
+        : remaining_(size)
+        , results_(size)
+        , defer_(defer) {
+    }
+
+    void settle(size_t index, TaskState state, any &&value) {
+        results_[index].state_ = state;
+        results_[index].value_ = std::move(value);
+        if (remaining_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            defer_.resolve(std::move(results_));
+    }
+
+    std::atomic<size_t>   remaining_;
+    std::vector<Settled>  results_;
+    Defer                 defer_;
+};
+
+struct AllSettledResolved {
+    void operator()(any &value) const {
+        state_->settle(index_, TaskState::kResolved, std::move(value));
+    }
+    IntrusivePtr<AllSettledState> state_;
+    size_t                        index_;
+};
+
+struct AllSettledRejected {
+    void operator()(any &reason) const {
+        state_->settle(index_, TaskState::kRejected, std::move(reason));
+    }
+    IntrusivePtr<AllSettledState> state_;
+    size_t                        index_;
+};
+
+Promise allSettled(const std::vector<Promise> &promise_list) {
+    if (promise_list.size() == 0) {
+        return resolve(std::vector<Settled>());
+    }
+
+    return newPromise([&promise_list](Defer &defer) {
+        IntrusivePtr<AllSettledState> state = makeIntrusive<AllSettledState>(promise_list.size(), defer);
+        WeakPromises promises;
+        promises.reserve(promise_list.size());
+        for (size_t index = 0; index < promise_list.size(); ++index) {
+            Promise promise = promise_list[index];
+            promise.then(AllSettledResolved{ state, index },
+                         AllSettledRejected{ state, index });
+            promises.push_back(weakPromiseOf(promise));
+        }
+
+        // Not by the state, as all() does
+        defer.onCancel([promises]() {
+            for (const IntrusiveWeakPtr<PromiseHolder> &promise : promises)
+                promiseOf(promise).cancel();
+        });
+    });
+}
+
+/*
+ * Shared by the handlers of some() and anyOf(). A slot is taken by the
+ * counter before the value is stored, and the promise is settled by the
+ * one which stores the last needed value, so both resolving and rejecting
+ * can not happen. At most "count" values and "size - count + 1" reasons
+ * are stored.
+ */
+struct SomeState : public RefCounted<SomeState> {
+    SomeState(size_t count, WeakPromises &&promises, LoserPolicy losers, const Defer &defer)
+        : count_(count)
+        , resolved_(0)
+        , resolvedStored_(0)
+        , rejected_(0)
+        , rejectedStored_(0)
+        , values_(count)
+        , reasons_(promises.size() - count + 1)
+        , promises_(std::move(promises))
+        , losers_(losers)
+        , defer_(defer) {
+    }
+
+    void resolve(size_t index, any &&value) {
+        size_t slot = resolved_.fetch_add(1, std::memory_order_relaxed);
+        if (slot >= count_) return;
+        values_[slot] = std::move(value);
+        if (resolvedStored_.fetch_add(1, std::memory_order_acq_rel) + 1 == count_) {
+            if (count_ == 1)
+                defer_.resolve(std::move(values_.front()));
+            else
+                defer_.resolve(any(std::move(values_)));
+            settleLosers(index);
+        }
+    }
+
+    void reject(size_t index, any &&reason) {
+        size_t slot = rejected_.fetch_add(1, std::memory_order_relaxed);
+        if (slot >= reasons_.size()) return;
+        reasons_[slot] = std::move(reason);
+        if (rejectedStored_.fetch_add(1, std::memory_order_acq_rel) + 1 == reasons_.size()) {
+            defer_.reject(std::make_exception_ptr(aggregate_error(std::move(reasons_))));
+            settleLosers(index);
+        }
+    }
+
+    // The promise of index is running this handler, the settled ones
+    // ignore it.
+    void settleLosers(size_t index) {
+        if (losers_ == LoserPolicy::kKeep) return;
+        for (size_t i = 0; i < promises_.size(); ++i) {
+            if (i == index) continue;
+            Promise promise = promiseOf(promises_[i]);
+            if (losers_ == LoserPolicy::kCancel)
+                promise.cancel();
+            else if (losers_ == LoserPolicy::kReject)
+                promise.reject();
+            else
+                promise.resolve();
+        }
+    }
+
+    size_t               count_;
+    std::atomic<size_t>  resolved_;
+    std::atomic<size_t>  resolvedStored_;
+    std::atomic<size_t>  rejected_;
+    std::atomic<size_t>  rejectedStored_;
+    std::vector<any>     values_;
+    std::vector<any>     reasons_;
+    WeakPromises         promises_;
+    LoserPolicy          losers_;
+    Defer                defer_;
+};
+
+struct SomeResolved {
+    void operator()(any &value) const {
+        state_->resolve(index_, std::move(value));
+    }
+    IntrusivePtr<SomeState> state_;
+    size_t                  index_;
+};
+
+struct SomeRejected {
+    void operator()(any &reason) const {
+        state_->reject(index_, std::move(reason));
+    }
+    IntrusivePtr<SomeState> state_;
+    size_t                  index_;
+};
+
+Promise some(size_t count, const std::vector<Promise> &promise_list, LoserPolicy losers) {
+    if (count == 0) {
+        return resolve();
+    }
+    if (count > promise_list.size()) {
+        return reject(std::make_exception_ptr(aggregate_error(std::vector<any>())));
+    }
 
-            ++index;
+    return newPromise([&](Defer &defer) {
+        // The losers may be settled as soon as the handlers are added
+        WeakPromises promises;
+        promises.reserve(promise_list.size());
+        for (const Promise &promise : promise_list)
+            promises.push_back(weakPromiseOf(promise));
+        IntrusivePtr<SomeState> state = makeIntrusive<SomeState>(count, WeakPromises(promises), losers, defer);
+
+        for (size_t index = 0; index < promise_list.size(); ++index) {
+            Promise promise = promise_list[index];
+            promise.then(SomeResolved{ state, index },
+                         SomeRejected{ state, index });
         }
+
+        // Not by the state, as all() does
+        defer.onCancel([promises]() {
+            for (const IntrusiveWeakPtr<PromiseHolder> &promise : promises)
+                promiseOf(promise).cancel();
+        });
     });
 }
 
+Promise anyOf(const std::vector<Promise> &promise_list, LoserPolicy losers) {
+    return some(1, promise_list, losers);
+}
+
 static Promise race(const std::list<Promise> &promise_list, std::shared_ptr<int> winner) {
     return newPromise([=](Defer &defer) {
+        WeakPromises promises;
         int index = 0;
         for (auto it = promise_list.begin(); it != promise_list.end(); ++it, ++index) {
             auto promise = *it;
-            promise.then([=](const any &arg) {
+            // The value is moved to the race, as then(defer) does
+            promise.then([=](any arg) -> any {
                 *winner = index;
-                defer.resolve(arg);
-                return arg;
-            }, [=](const any &arg) {
+                defer.resolve(std::move(arg));
+                return nullptr;
+            }, [=](any arg) -> any {
                 *winner = index;
-                defer.reject(arg);
-                return arg;
+                defer.reject(std::move(arg));
+                return nullptr;
             });
+            promises.push_back(weakPromiseOf(promise));
         }
+
+        defer.onCancel([promises]() {
+            for (const IntrusiveWeakPtr<PromiseHolder> &promise : promises)
+                promiseOf(promise).cancel();
+        });
     });
 }
 
@@ -796,6 +2268,128 @@ Promise raceAndResolve(const std::list<Promise> &promise_list) {
     });
 }
 
+/*
+ * Shared by the lanes of mapLimit() and forEachLimit(). Each lane is a
+ * doWhile() loop which takes the next index and waits for its promise,
+ * so at most one promise per lane is in flight and a promise resolved
+ * at once is looped instead of recursed.
+ */
+struct LimitState : public RefCounted<LimitState> {
+    LimitState(size_t size, size_t lanes, const std::function<Promise(size_t index)> &launch, bool collect)
+        : size_(size)
+        , next_(0)
+        , stopped_(false)
+        , values_(collect ? size : 0)
+        , running_(lanes)
+        , launch_(launch) {
+    }
+
+    void setRunning(size_t lane, const Promise &promise) {
+        IntrusiveWeakPtr<PromiseHolder> running = weakPromiseOf(promise);
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<std::mutex> lock(mutex_);
+#endif
+            running_[lane] = running;
+        }
+        if (stopped_.load(std::memory_order_acquire))
+            promise.cancel();
+    }
+
+    void cancel() {
+        stopped_.store(true, std::memory_order_release);
+        WeakPromises running;
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<std::mutex> lock(mutex_);
+#endif
+            running = running_;
+        }
+        for (const IntrusiveWeakPtr<PromiseHolder> &promise : running)
+            promiseOf(promise).cancel();
+    }
+
+    size_t               size_;
+    std::atomic<size_t>  next_;
+    std::atomic<bool>    stopped_;
+    std::vector<any>     values_;   // empty if the values are not collected
+    WeakPromises         running_;  // the promise in flight of each lane, by weak
+                                    // reference as its handlers keep the state
+#if PROMISE_MULTITHREAD
+    std::mutex           mutex_;
+#endif
+    std::function<Promise(size_t index)> launch_;
+};
+
+struct LimitResolved {
+    void operator()(any &value) const {
+        if (!state_->values_.empty())
+            state_->values_[index_] = std::move(value);
+        loop_.doContinue();
+    }
+    IntrusivePtr<LimitState> state_;
+    size_t                   index_;
+    DeferLoop                loop_;
+};
+
+struct LimitRejected {
+    void operator()(any &reason) const {
+        state_->stopped_.store(true, std::memory_order_release);
+        loop_.reject(std::move(reason));
+    }
+    IntrusivePtr<LimitState> state_;
+    DeferLoop                loop_;
+};
+
+static Promise runLimit(size_t size, size_t limit, const std::function<Promise(size_t index)> &launch, bool collect) {
+    size_t lanes = (limit == 0 ? 1 : (limit < size ? limit : size));
+    return newPromise([&](Defer &defer) {
+        IntrusivePtr<LimitState> state = makeIntrusive<LimitState>(size, lanes, launch, collect);
+        defer.onCancel([state]() {
+            state->cancel();
+        });
+
+        std::vector<Promise> loops;
+        loops.reserve(lanes);
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            loops.push_back(doWhile([state, lane](DeferLoop &loop) {
+                size_t index = state->next_.fetch_add(1, std::memory_order_relaxed);
+                if (index >= state->size_ || state->stopped_.load(std::memory_order_acquire)) {
+                    loop.doBreak();
+                    return;
+                }
+                Promise promise;
+                try {
+                    promise = state->launch_(index);
+                }
+                catch (...) {
+                    state->stopped_.store(true, std::memory_order_release);
+                    throw;
+                }
+                state->setRunning(lane, promise);
+                promise.then(LimitResolved{ state, index, loop }, LimitRejected{ state, loop });
+            }));
+        }
+
+        all(loops).then([state, defer]() {
+            if (state->values_.empty())
+                defer.resolve();
+            else
+                defer.resolve(any(std::move(state->values_)));
+        }, [defer](const any &reason) {
+            defer.reject(reason);
+        });
+    });
+}
+
+Promise mapLimit(size_t size, size_t limit, const std::function<Promise(size_t index)> &launch) {
+    return runLimit(size, limit, launch, true);
+}
+
+Promise forEachLimit(size_t size, size_t limit, const std::function<Promise(size_t index)> &launch) {
+    return runLimit(size, limit, launch, false);
+}
+
  
 } // namespace promise
 
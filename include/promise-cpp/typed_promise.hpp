@@ -0,0 +1,825 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+#ifndef INC_TYPED_PROMISE_HPP_
+#define INC_TYPED_PROMISE_HPP_
+
+/*
+ * Statically typed promise, promise::typed::Promise<T> and Defer<T>.
+ *
+ * The value is stored as T in the shared state and the handlers are called
+ * directly, no any or std::vector<any> is created. then() deduces the type
+ * of next promise from the return type of handler, and a handler returning
+ * Promise<U> is flattened to Promise<U>. The reason of rejection is always
+ * std::exception_ptr, a fail handler may accept std::exception_ptr, or an
+ * exception type which is matched as a catch clause does.
+ *
+ * Unlike the untyped Promise, then() returns a new promise and the value is
+ * shared by all handlers of the same promise.
+ *
+ * Promise<T> can be converted to and from the untyped promise::Promise.
+ */
+
+#include <exception>
+#include <stdexcept>
+#include <type_traits>
+#include <iterator>
+#include <vector>
+#include "promise.hpp"
+
+namespace promise {
+namespace typed {
+
+template<typename T> class Promise;
+template<typename T> class Defer;
+
+// Stored type of Promise<void>
+struct Void {};
+
+template<typename T>
+struct Stored { typedef T type; };
+template<>
+struct Stored<void> { typedef Void type; };
+
+// Promise<T> returned by handler is flattened to T
+template<typename T>
+struct Unwrap { typedef T type; };
+template<typename T>
+struct Unwrap<Promise<T>> { typedef T type; };
+
+template<typename S>
+struct State;
+
+template<typename S>
+struct Continuation {
+    virtual ~Continuation() {}
+    // Called once when the state is settled
+    virtual void run(State<S> &state) = 0;
+    // Called instead of run() if the state is released before settled
+    virtual void cancel() = 0;
+};
+
+template<typename S>
+struct State : public RefCounted<State<S>> {
+    typedef SmallVector<Continuation<S> *, 1> ContinuationList;
+
+    State()
+        : state_(TaskState::kPending)
+        , handled_(false) {
+    }
+    virtual ~State() {
+        if (state_ == TaskState::kResolved)
+            value().~S();
+    }
+
+    void dispose() {
+        for (Continuation<S> *continuation : continuations_)
+            continuation->cancel();
+        continuations_.clear();
+        if (state_ == TaskState::kRejected && !handled_)
+            PromiseHolder::onUncaughtException(any(error_));
+    }
+
+    // Valid only if resolved
+    inline S &value() {
+        return *reinterpret_cast<S *>(storage_);
+    }
+
+    // Run the continuation now if settled, or later when it is settled
+    void addContinuation(Continuation<S> *continuation) {
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<std::mutex> lock(mutex_);
+#endif
+            handled_ = true;
+            if (state_ == TaskState::kPending) {
+                continuations_.push_back(continuation);
+                return;
+            }
+        }
+        continuation->run(*this);
+    }
+
+    template<typename ...ARGS>
+    void resolve(ARGS &&...args) {
+        ContinuationList continuations;
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<std::mutex> lock(mutex_);
+#endif
+            if (state_ != TaskState::kPending) return;
+            new (storage_) S(std::forward<ARGS>(args)...);
+            state_ = TaskState::kResolved;
+            continuations.splice(continuations_);
+        }
+        for (Continuation<S> *continuation : continuations)
+            continuation->run(*this);
+    }
+
+    void reject(const std::exception_ptr &error) {
+        ContinuationList continuations;
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<std::mutex> lock(mutex_);
+#endif
+            if (state_ != TaskState::kPending) return;
+            error_ = error;
+            state_ = TaskState::kRejected;
+            continuations.splice(continuations_);
+        }
+        for (Continuation<S> *continuation : continuations)
+            continuation->run(*this);
+    }
+
+    TaskState          state_;
+    bool               handled_;
+    std::exception_ptr error_;
+    ContinuationList   continuations_;
+#if PROMISE_MULTITHREAD
+    std::mutex         mutex_;
+#endif
+    alignas(S) unsigned char storage_[sizeof(S)];
+};
+
+/*
+ * State of the promise returned by then(), it is also the continuation
+ * of previous state. The handler is destroyed after called.
+ */
+template<typename S, typename R, typename HANDLER>
+struct ThenState : public State<R>, public Continuation<S> {
+    explicit ThenState(HANDLER &&handler) {
+        new (handler_) HANDLER(std::move(handler));
+    }
+
+    void run(State<S> &previous) override {
+        HANDLER &handler = *reinterpret_cast<HANDLER *>(handler_);
+        try {
+            if (previous.state_ == TaskState::kResolved)
+                handler.onResolved(previous, *this);
+            else
+                handler.onRejected(previous, *this);
+        }
+        catch (...) {
+            this->reject(std::current_exception());
+        }
+        handler.~HANDLER();
+        this->release();
+    }
+
+    void cancel() override {
+        reinterpret_cast<HANDLER *>(handler_)->~HANDLER();
+        this->release();
+    }
+
+    alignas(HANDLER) unsigned char handler_[sizeof(HANDLER)];
+};
+
+// Continuation which only calls the handler
+template<typename S, typename HANDLER>
+struct Observer : public Continuation<S> {
+    explicit Observer(HANDLER &&handler)
+        : handler_(std::move(handler)) {
+    }
+
+    void run(State<S> &state) override {
+        handler_(state);
+        delete this;
+    }
+
+    void cancel() override {
+        delete this;
+    }
+
+#if PROMISE_POOL
+    static void *operator new(size_t size) {
+        return poolAllocate(size);
+    }
+    static void operator delete(void *ptr, size_t size) {
+        poolFree(ptr, size);
+    }
+#endif
+
+    HANDLER handler_;
+};
+
+// Settle next state with the value of previous one
+template<typename S>
+struct ForwardHandler {
+    explicit ForwardHandler(State<S> *next)
+        : next_(next) {
+    }
+
+    void operator()(State<S> &previous) const {
+        if (previous.state_ == TaskState::kResolved) {
+            try {
+                next_->resolve(previous.value());
+            }
+            catch (...) {
+                next_->reject(std::current_exception());
+            }
+        }
+        else
+            next_->reject(previous.error_);
+    }
+
+    IntrusivePtr<State<S>> next_;
+};
+
+// Call handler with the value, or without argument for Promise<void>
+template<typename F>
+inline auto invokeHandler(F &f, Void &) -> decltype(f()) {
+    return f();
+}
+
+template<typename F, typename S>
+inline auto invokeHandler(F &f, S &value) -> decltype(f(value)) {
+    return f(value);
+}
+
+// Settle next state by the result of call()
+template<typename U>
+struct Settle {
+    template<typename R, typename CALL>
+    static void call(State<R> &next, CALL &&call) {
+        next.resolve(call());
+    }
+};
+
+template<>
+struct Settle<void> {
+    template<typename R, typename CALL>
+    static void call(State<R> &next, CALL &&call) {
+        call();
+        next.resolve();
+    }
+};
+
+template<typename T>
+struct Settle<Promise<T>> {
+    template<typename R, typename CALL>
+    static void call(State<R> &next, CALL &&call) {
+        call().forward(next);
+    }
+};
+
+template<typename F, typename S>
+struct ResolvedResult {
+    typedef decltype(invokeHandler(std::declval<F &>(), std::declval<S &>())) result_type;
+    typedef typename std::remove_cvref<result_type>::type decay_type;
+    typedef typename Unwrap<decay_type>::type next_type;
+};
+
+template<typename G>
+struct RejectedResult {
+    typedef typename call_traits<G>::result_type result_type;
+    typedef typename std::remove_cvref<result_type>::type decay_type;
+    typedef typename Unwrap<decay_type>::type next_type;
+};
+
+/*
+ * Call the fail handler if the reason matches its parameter, which may be
+ * empty, std::exception_ptr or an exception type.
+ */
+template<typename G,
+         typename ARGS = typename call_traits<G>::argument_type>
+struct RejectedCall;
+
+template<typename G>
+struct RejectedCall<G, std::tuple<>> {
+    typedef typename RejectedResult<G>::result_type U;
+
+    template<typename R>
+    static void call(G &onRejected, const std::exception_ptr &, State<R> &next) {
+        Settle<typename RejectedResult<G>::decay_type>::call(next, [&]() -> U {
+            return onRejected();
+        });
+    }
+};
+
+template<typename G, typename A>
+struct RejectedCall<G, std::tuple<A>> {
+    typedef typename RejectedResult<G>::result_type U;
+    typedef typename RejectedResult<G>::decay_type D;
+    typedef typename std::remove_cvref<A>::type E;
+
+    template<typename R>
+    static void call(G &onRejected, const std::exception_ptr &error, State<R> &next) {
+        call(onRejected, error, next, std::is_same<E, std::exception_ptr>());
+    }
+
+    template<typename R>
+    static void call(G &onRejected, const std::exception_ptr &error, State<R> &next, std::true_type) {
+        Settle<D>::call(next, [&]() -> U {
+            return onRejected(error);
+        });
+    }
+
+    template<typename R>
+    static void call(G &onRejected, const std::exception_ptr &error, State<R> &next, std::false_type) {
+        if (any_exception_known(error)) {
+            E *ex = any_exception_cast<E>(error);
+            if (ex != nullptr) {
+                Settle<D>::call(next, [&]() -> U {
+                    return onRejected(*ex);
+                });
+                return;
+            }
+            next.reject(error);
+            return;
+        }
+
+        try {
+            std::rethrow_exception(error);
+        }
+        catch (E &ex) {
+            Settle<D>::call(next, [&]() -> U {
+                return onRejected(ex);
+            });
+            return;
+        }
+        catch (...) {
+        }
+        next.reject(error);
+    }
+};
+
+// Handlers of then(onResolved), then(onResolved, onRejected), fail(onRejected) and finally(onFinally)
+template<typename F>
+struct ResolvedHandler {
+    explicit ResolvedHandler(F &&onResolved)
+        : onResolved_(std::move(onResolved)) {
+    }
+
+    template<typename S, typename R>
+    void onResolved(State<S> &previous, State<R> &next) {
+        typedef ResolvedResult<F, S> Result;
+        Settle<typename Result::decay_type>::call(next, [&]() -> typename Result::result_type {
+            return invokeHandler(onResolved_, previous.value());
+        });
+    }
+
+    template<typename S, typename R>
+    void onRejected(State<S> &previous, State<R> &next) {
+        next.reject(previous.error_);
+    }
+
+    F onResolved_;
+};
+
+template<typename F, typename G>
+struct ResolvedRejectedHandler : public ResolvedHandler<F> {
+    ResolvedRejectedHandler(F &&onResolved, G &&onRejected)
+        : ResolvedHandler<F>(std::move(onResolved))
+        , onRejected_(std::move(onRejected)) {
+    }
+
+    template<typename S, typename R>
+    void onRejected(State<S> &previous, State<R> &next) {
+        RejectedCall<G>::call(onRejected_, previous.error_, next);
+    }
+
+    G onRejected_;
+};
+
+template<typename G>
+struct RejectedHandler {
+    explicit RejectedHandler(G &&onRejected)
+        : onRejected_(std::move(onRejected)) {
+    }
+
+    template<typename S>
+    void onResolved(State<S> &previous, State<S> &next) {
+        next.resolve(previous.value());
+    }
+
+    template<typename S>
+    void onRejected(State<S> &previous, State<S> &next) {
+        RejectedCall<G>::call(onRejected_, previous.error_, next);
+    }
+
+    G onRejected_;
+};
+
+template<typename F>
+struct FinallyHandler {
+    explicit FinallyHandler(F &&onFinally)
+        : onFinally_(std::move(onFinally)) {
+    }
+
+    template<typename S>
+    void onResolved(State<S> &previous, State<S> &next) {
+        onFinally_();
+        next.resolve(previous.value());
+    }
+
+    template<typename S>
+    void onRejected(State<S> &previous, State<S> &next) {
+        onFinally_();
+        next.reject(previous.error_);
+    }
+
+    F onFinally_;
+};
+
+// Conversion between the untyped promise
+template<typename S>
+inline const S &castValue(const any &value) {
+    return any_cast<const S &>(value);
+}
+
+template<>
+inline const any &castValue<any>(const any &value) {
+    return value;
+}
+
+inline std::exception_ptr toExceptionPtr(const any &reason) {
+    if (reason.type() == type_id<std::exception_ptr>())
+        return any_cast<std::exception_ptr>(reason);
+    return std::make_exception_ptr(reason);
+}
+
+template<typename S>
+struct FromUntypedResolved {
+    void operator()(const any &value) const {
+        try {
+            state_->resolve(castValue<S>(value));
+        }
+        catch (...) {
+            state_->reject(std::current_exception());
+        }
+    }
+    IntrusivePtr<State<S>> state_;
+};
+
+template<>
+struct FromUntypedResolved<Void> {
+    void operator()(const any &) const {
+        state_->resolve();
+    }
+    IntrusivePtr<State<Void>> state_;
+};
+
+template<typename S>
+struct FromUntypedRejected {
+    void operator()(const any &reason) const {
+        state_->reject(toExceptionPtr(reason));
+    }
+    IntrusivePtr<State<S>> state_;
+};
+
+template<typename S>
+struct ToUntypedHandler {
+    void operator()(State<S> &state) const {
+        if (state.state_ == TaskState::kResolved)
+            resolve(state.value());
+        else
+            reject(state.error_);
+    }
+
+    void resolve(const Void &) const {
+        promise_.resolve();
+    }
+
+    template<typename V>
+    void resolve(const V &value) const {
+        promise_.resolve(value);
+    }
+
+    // The reason from an untyped promise is restored as is
+    void reject(const std::exception_ptr &error) const {
+        try {
+            std::rethrow_exception(error);
+        }
+        catch (const any &reason) {
+            promise_.reject(reason);
+            return;
+        }
+        catch (...) {
+        }
+        promise_.reject(any(error));
+    }
+
+    ::promise::Promise promise_;
+};
+
+template<typename T>
+class Promise {
+public:
+    typedef T value_type;
+    typedef typename Stored<T>::type stored_type;
+
+    Promise() {
+    }
+
+    // The promise is rejected with bad_any_cast if the untyped value is not T
+    explicit Promise(const ::promise::Promise &untyped)
+        : state_(makeIntrusive<State<stored_type>>()) {
+        ::promise::Promise copy = untyped;
+        copy.then(FromUntypedResolved<stored_type>{ state_ },
+                  FromUntypedRejected<stored_type>{ state_ });
+    }
+
+    operator ::promise::Promise() const {
+        ::promise::Promise untyped = ::promise::newPromise();
+        state_->addContinuation(new Observer<stored_type, ToUntypedHandler<stored_type>>(
+            ToUntypedHandler<stored_type>{ untyped }));
+        return untyped;
+    }
+
+    template<typename F>
+    Promise<typename ResolvedResult<typename std::decay<F>::type, typename Stored<T>::type>::next_type>
+    then(F &&onResolved) const {
+        typedef typename std::decay<F>::type FN;
+        typedef typename ResolvedResult<FN, stored_type>::next_type U;
+        return chain<U>(ResolvedHandler<FN>(FN(std::forward<F>(onResolved))));
+    }
+
+    template<typename F, typename G>
+    Promise<typename ResolvedResult<typename std::decay<F>::type, typename Stored<T>::type>::next_type>
+    then(F &&onResolved, G &&onRejected) const {
+        typedef typename std::decay<F>::type FN;
+        typedef typename std::decay<G>::type GN;
+        typedef typename ResolvedResult<FN, stored_type>::next_type U;
+        static_assert(std::is_same<typename RejectedResult<GN>::next_type, U>::value,
+            "onRejected must return the same type as onResolved");
+        return chain<U>(ResolvedRejectedHandler<FN, GN>(FN(std::forward<F>(onResolved)),
+                                                        GN(std::forward<G>(onRejected))));
+    }
+
+    template<typename G>
+    Promise<T> fail(G &&onRejected) const {
+        typedef typename std::decay<G>::type GN;
+        static_assert(std::is_same<typename RejectedResult<GN>::next_type, T>::value,
+            "onRejected must return T or Promise<T>");
+        return chain<T>(RejectedHandler<GN>(GN(std::forward<G>(onRejected))));
+    }
+
+    template<typename F>
+    Promise<T> finally(F &&onFinally) const {
+        typedef typename std::decay<F>::type FN;
+        return chain<T>(FinallyHandler<FN>(FN(std::forward<F>(onFinally))));
+    }
+
+    template<typename ...ARGS>
+    inline void resolve(ARGS &&...args) const {
+        state_->resolve(std::forward<ARGS>(args)...);
+    }
+
+    inline void reject(const std::exception_ptr &error) const {
+        state_->reject(error);
+    }
+
+    template<typename E>
+    inline void reject(const E &error) const {
+        state_->reject(std::make_exception_ptr(error));
+    }
+
+    inline void clear() {
+        state_.reset();
+    }
+
+    inline explicit operator bool() const {
+        return static_cast<bool>(state_);
+    }
+
+private:
+    template<typename> friend class Promise;
+    template<typename> friend class Defer;
+    template<typename> friend struct Settle;
+    template<typename> friend struct AllOf;
+    template<typename U, typename FUNC> friend Promise<U> newPromise(FUNC &&run);
+    template<typename U> friend Promise<U> newPromise();
+
+    explicit Promise(const IntrusivePtr<State<stored_type>> &state)
+        : state_(state) {
+    }
+
+    template<typename U, typename HANDLER>
+    Promise<U> chain(HANDLER &&handler) const {
+        typedef typename Stored<U>::type R;
+        typedef ThenState<stored_type, R, typename std::decay<HANDLER>::type> Next;
+        Next *next = new Next(std::move(handler));
+        IntrusivePtr<State<R>> nextState(next);
+        next->retain();     // released by run() or cancel()
+        state_->addContinuation(next);
+        return Promise<U>(nextState);
+    }
+
+    // Settle next state when this one is settled
+    void forward(State<stored_type> &next) const {
+        if (!state_)
+            next.reject(std::make_exception_ptr(std::invalid_argument("empty promise")));
+        else
+            state_->addContinuation(new Observer<stored_type, ForwardHandler<stored_type>>(
+                ForwardHandler<stored_type>(&next)));
+    }
+
+    IntrusivePtr<State<stored_type>> state_;
+};
+
+template<typename T>
+class Defer {
+public:
+    template<typename ...ARGS>
+    inline void resolve(ARGS &&...args) const {
+        state_->resolve(std::forward<ARGS>(args)...);
+    }
+
+    inline void reject(const std::exception_ptr &error) const {
+        state_->reject(error);
+    }
+
+    template<typename E>
+    inline void reject(const E &error) const {
+        state_->reject(std::make_exception_ptr(error));
+    }
+
+    inline Promise<T> getPromise() const {
+        return Promise<T>(state_);
+    }
+
+private:
+    template<typename U, typename FUNC> friend Promise<U> newPromise(FUNC &&run);
+
+    explicit Defer(const IntrusivePtr<State<typename Stored<T>::type>> &state)
+        : state_(state) {
+    }
+
+    IntrusivePtr<State<typename Stored<T>::type>> state_;
+};
+
+template<typename T, typename FUNC>
+inline Promise<T> newPromise(FUNC &&run) {
+    Defer<T> defer(makeIntrusive<State<typename Stored<T>::type>>());
+    try {
+        run(defer);
+    }
+    catch (...) {
+        defer.reject(std::current_exception());
+    }
+    return defer.getPromise();
+}
+
+template<typename T>
+inline Promise<T> newPromise() {
+    return Promise<T>(makeIntrusive<State<typename Stored<T>::type>>());
+}
+
+template<typename T>
+inline Promise<typename std::decay<T>::type> resolve(T &&value) {
+    Promise<typename std::decay<T>::type> promise = newPromise<typename std::decay<T>::type>();
+    promise.resolve(std::forward<T>(value));
+    return promise;
+}
+
+inline Promise<void> resolve() {
+    Promise<void> promise = newPromise<void>();
+    promise.resolve();
+    return promise;
+}
+
+template<typename T, typename E>
+inline Promise<T> reject(const E &error) {
+    Promise<T> promise = newPromise<T>();
+    promise.reject(error);
+    return promise;
+}
+
+// Value of the promise returned by all(), nothing for Promise<void>
+template<typename T>
+struct AllResult { typedef std::vector<T> type; };
+template<>
+struct AllResult<void> { typedef void type; };
+
+// Shared by the observers of all(), the last resolved one settles next_
+template<typename T>
+struct AllState : public RefCounted<AllState<T>> {
+    typedef typename Stored<typename AllResult<T>::type>::type result_type;
+
+    AllState(size_t size, const IntrusivePtr<State<result_type>> &next)
+        : remaining_(size)
+        , values_(size)
+        , next_(next) {
+    }
+
+    void set(size_t index, const T &value) {
+        values_[index] = value;
+    }
+
+    void resolve() {
+        next_->resolve(std::move(values_));
+    }
+
+    std::atomic<size_t>              remaining_;
+    std::vector<T>                   values_;
+    IntrusivePtr<State<result_type>> next_;
+};
+
+template<>
+struct AllState<void> : public RefCounted<AllState<void>> {
+    typedef Void result_type;
+
+    AllState(size_t size, const IntrusivePtr<State<result_type>> &next)
+        : remaining_(size)
+        , next_(next) {
+    }
+
+    void set(size_t, const Void &) {
+    }
+
+    void resolve() {
+        next_->resolve();
+    }
+
+    std::atomic<size_t>              remaining_;
+    IntrusivePtr<State<result_type>> next_;
+};
+
+template<typename T>
+struct AllHandler {
+    void operator()(State<typename Stored<T>::type> &state) const {
+        if (state.state_ == TaskState::kRejected) {
+            all_->next_->reject(state.error_);
+            return;
+        }
+        all_->set(index_, state.value());
+        if (all_->remaining_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            all_->resolve();
+    }
+
+    IntrusivePtr<AllState<T>> all_;
+    size_t                    index_;
+};
+
+template<typename T>
+struct AllOf {
+    typedef typename AllResult<T>::type R;
+    typedef typename Stored<T>::type S;
+
+    template<typename ITERATOR>
+    static Promise<R> run(ITERATOR first, ITERATOR last) {
+        Promise<R> promise = newPromise<R>();
+        size_t size = (size_t)std::distance(first, last);
+        if (size == 0) {
+            promise.resolve();
+            return promise;
+        }
+
+        IntrusivePtr<AllState<T>> all = makeIntrusive<AllState<T>>(size, promise.state_);
+        for (size_t index = 0; first != last; ++first, ++index) {
+            const Promise<T> &input = *first;
+            if (!input.state_) {
+                promise.reject(std::invalid_argument("empty promise"));
+                break;
+            }
+            input.state_->addContinuation(new Observer<S, AllHandler<T>>(AllHandler<T>{ all, index }));
+        }
+        return promise;
+    }
+};
+
+/*
+ * Resolved with the values of all promises in order, as std::vector<T>, or
+ * with nothing for Promise<void>. Rejected by the first rejected one.
+ * The promises are not copied, and T must be default constructible.
+ */
+template<typename ITERATOR>
+inline Promise<typename AllResult<typename std::iterator_traits<ITERATOR>::value_type::value_type>::type>
+all(ITERATOR first, ITERATOR last) {
+    return AllOf<typename std::iterator_traits<ITERATOR>::value_type::value_type>::run(first, last);
+}
+
+template<typename T>
+inline Promise<typename AllResult<T>::type> all(const std::vector<Promise<T>> &promises) {
+    return AllOf<T>::run(promises.begin(), promises.end());
+}
+
+} // namespace typed
+} // namespace promise
+
+#endif